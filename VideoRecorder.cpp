@@ -11,18 +11,257 @@
 #define LOGE(...) fprintf(stderr, __VA_ARGS__)
 #endif
 
+#ifdef REPLAY
+#define LOG(...) do {} while(0)
+#define LOGE(...) fprintf(stderr, __VA_ARGS__)
+#endif
+
 #include "VideoRecorder.h"
 
+#include <pthread.h>
+#include <time.h>
+
 extern "C" {
 #include <libavformat/avformat.h>
 #include <libavcodec/avcodec.h>
 #include <libswscale/swscale.h>
 }
 
+#if defined(ANDROID) && defined(__arm__)
+#include <cpu-features.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 // Do not use C++ exceptions, templates, or RTTI
 
 namespace AVR {
 
+#define MAX_AUDIO_SOURCES			4
+#define MAX_AUDIO_SOURCE_CHANNELS	8
+#define AUDIO_CONVERT_CHUNK			512		// samples converted at a time when a source's channel layout differs
+#define AUDIO_SOURCE_JITTER_FRAMES	8		// encoder frames a source may run ahead of the others before we stop waiting for them
+#define AUDIO_SOURCE_TOLERANCE_MS	20		// timestamp jitter absorbed without inserting silence or dropping samples
+#define AUDIO_GAIN_UNITY			4096	// gains are stored in 4.12 fixed point
+
+#define THUMBNAIL_FILE_MAGIC		0x424D4854	// 'THMB'
+
+#define INTERLEAVE_MAX_PACKETS		512			// per stream
+#define INTERLEAVE_DEFAULT_BYTES	(2 * 1024 * 1024)
+#define INTERLEAVE_DEFAULT_DELAY_MS	1000
+
+#define CAPTURE_FILE_MAGIC			0x43525641	// 'AVRC'
+#define CAPTURE_FILE_VERSION		2
+#define CAPTURE_BUFFER_SIZE			(1024 * 1024)
+
+static int64_t monotonic_time()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Capture files (SetCaptureFile) start with a CaptureFileHeader, followed by one CaptureRecord per call.
+// Each record's fixed fields come straight after it, then the call's sample/pixel data, then padding up
+// to 8 bytes so the next record is aligned. All values are in native byte order.
+
+struct CaptureFileHeader {
+	uint32_t magic;
+	uint32_t version;
+	int32_t video_format;		// VideoFrameFormat
+	int32_t video_width;
+	int32_t video_height;
+	uint32_t video_bitrate;
+	int32_t audio_format;		// AudioSampleFormat
+	int32_t audio_channels;
+	uint32_t audio_samplerate;
+	uint32_t audio_bitrate;
+	int32_t has_audio;
+	uint32_t reserved;
+	uint32_t interleave_max_bytes;	// SetInterleaveOptions as of Open, later calls get a record
+	uint32_t interleave_max_delay_ms;
+	int32_t interleave_policy;		// InterleaveOverflowPolicy
+	int32_t thumb_format;			// ThumbnailFormat
+	int32_t thumb_width;			// 0 when thumbnails are off
+	int32_t thumb_height;
+	uint32_t thumb_interval;
+	int32_t thumb_on_keyframe;
+};
+
+enum CaptureRecordType {
+	CaptureVideoFrame=1,		// CaptureVideoFrameFields, frame data
+	CaptureVideoPlanes,			// CaptureVideoPlanesFields, plane data back to back
+	CaptureAudioSamples,		// CaptureAudioSamplesFields, sample data
+	CaptureAddAudioSource,		// CaptureAddAudioSourceFields
+	CaptureAudioSourceGain,		// CaptureAudioSourceGainFields
+	CaptureAudioSourceSamples,	// CaptureAudioSourceSamplesFields, sample data
+	CaptureInterleaveOptions	// CaptureInterleaveOptionsFields
+};
+
+struct CaptureRecord {
+	uint32_t type;
+	uint32_t size;				// bytes of fields and data after this header, not counting padding
+	int64_t arrival;			// microseconds since Open
+};
+
+struct CaptureVideoFrameFields { uint64_t timestamp; };
+struct CaptureVideoPlanesFields { uint64_t timestamp; int32_t num_planes; int32_t reserved; int32_t strides[4]; uint32_t sizes[4]; };
+struct CaptureAudioSamplesFields { uint64_t num_samples; };
+struct CaptureAddAudioSourceFields { int32_t format; int32_t channels; float gain; int32_t reserved; };
+struct CaptureAudioSourceGainFields { int32_t source; float gain; };
+struct CaptureAudioSourceSamplesFields { int32_t source; int32_t reserved; uint64_t num_samples; uint64_t timestamp; };
+struct CaptureInterleaveOptionsFields { uint32_t max_bytes; uint32_t max_delay_ms; int32_t policy; int32_t reserved; };
+
+#ifdef AVR_TRACE
+
+// Pipeline tracing, compile with -DAVR_TRACE to enable. Every thread records begin/end events into its
+// own ring buffer, so recording takes no locks; the rings keep the most recent TRACE_EVENTS_PER_THREAD
+// events and are written out as Chrome trace JSON (chrome://tracing, ui.perfetto.dev) by trace_dump.
+
+#define TRACE_MAX_THREADS			8
+#define TRACE_EVENTS_PER_THREAD		16384
+
+struct TraceEvent {
+	int64_t time;		// microseconds on CLOCK_MONOTONIC
+	int64_t pts;
+	const char *name;	// string literal
+	int tid;
+	char phase;			// 'B' or 'E'
+};
+
+struct TraceRing {
+	volatile int claimed;
+	int tid;					// id of the thread that currently owns the ring
+	volatile uint32_t head;		// number of events ever written, the writer is the only one to advance it
+	TraceEvent events[TRACE_EVENTS_PER_THREAD];
+};
+
+static TraceRing trace_rings[TRACE_MAX_THREADS];
+static volatile int trace_next_tid = 0;
+static int64_t trace_start_time = 0;		// events before this (the last Open) aren't dumped
+static pthread_key_t trace_key;
+static pthread_once_t trace_key_once = PTHREAD_ONCE_INIT;
+
+// a thread gives its ring back when it exits, its events stay until they're overwritten
+static void trace_release_ring(void *ring)
+{
+	((TraceRing *)ring)->claimed = 0;
+}
+
+static void trace_create_key()
+{
+	pthread_key_create(&trace_key, trace_release_ring);
+}
+
+static void trace_event(const char *name, int64_t pts, char phase)
+{
+	pthread_once(&trace_key_once, trace_create_key);
+	
+	TraceRing *ring = (TraceRing *)pthread_getspecific(trace_key);
+	if(!ring) {
+		for(int i = 0; i < TRACE_MAX_THREADS && !ring; i++)
+			if(__sync_bool_compare_and_swap(&trace_rings[i].claimed, 0, 1))
+				ring = &trace_rings[i];
+		if(!ring)
+			return;		// more threads than rings, this one goes untraced
+		ring->tid = __sync_add_and_fetch(&trace_next_tid, 1);
+		pthread_setspecific(trace_key, ring);
+	}
+	
+	uint32_t head = ring->head;
+	TraceEvent *e = &ring->events[head % TRACE_EVENTS_PER_THREAD];
+	e->time = monotonic_time();
+	e->pts = pts;
+	e->name = name;
+	e->tid = ring->tid;
+	e->phase = phase;
+	__sync_synchronize();	// the event must be complete before a reader can see the new head
+	ring->head = head + 1;
+}
+
+// can be called while other threads are still recording
+static bool trace_dump(const char *filename)
+{
+	FILE *f = fopen(filename, "w");
+	if(!f) {
+		LOGE("could not open trace file '%s'\n", filename);
+		return false;
+	}
+	
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	bool first = true;
+	for(int i = 0; i < TRACE_MAX_THREADS; i++) {
+		TraceRing *ring = &trace_rings[i];
+		uint32_t head = ring->head;
+		__sync_synchronize();
+		uint32_t start = head > TRACE_EVENTS_PER_THREAD ? head - TRACE_EVENTS_PER_THREAD : 0;
+		
+		for(uint32_t n = start; n < head; n++) {
+			TraceEvent e = ring->events[n % TRACE_EVENTS_PER_THREAD];
+			__sync_synchronize();
+			// skip the event if the writer lapped us while we were copying it
+			// (slot n is rewritten while head == n + TRACE_EVENTS_PER_THREAD, before head moves on)
+			if(ring->head - n >= TRACE_EVENTS_PER_THREAD)
+				continue;
+			if(e.time < trace_start_time)
+				continue;
+			
+			fprintf(f, "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld,\"pid\":1,\"tid\":%d", first ? "" : ",\n", e.name, e.phase, (long long)(e.time - trace_start_time), e.tid);
+			if(e.pts != AV_NOPTS_VALUE)
+				fprintf(f, ",\"args\":{\"pts\":%lld}", (long long)e.pts);
+			fprintf(f, "}");
+			first = false;
+		}
+	}
+	fprintf(f, "\n]}\n");
+	
+	bool ok = !ferror(f);
+	if(fclose(f) != 0 || !ok) {
+		LOGE("could not write trace file '%s'\n", filename);
+		return false;
+	}
+	return true;
+}
+
+class TraceScope {
+public:
+	TraceScope(const char *name, int64_t pts) : name(name), pts(pts) { trace_event(name, pts, 'B'); }
+	~TraceScope() { trace_event(name, pts, 'E'); }
+private:
+	const char *name;
+	int64_t pts;
+};
+
+#define TRACE_SCOPE(name, pts) TraceScope trace_scope(name, pts)
+
+#else
+
+#define TRACE_SCOPE(name, pts)
+
+#endif // AVR_TRACE
+
+// One input of the audio mixer. Samples are converted to the encoder's S16 channel layout as they arrive
+// and wait in a ring buffer until every source has enough to mix a whole encoder frame.
+struct AudioSource {
+	AVSampleFormat sample_format;
+	int sample_size;
+	int channels;
+	int gain;
+	int16_t *buffer;
+	int capacity;		// in samples per channel
+	int read_pos;		// buffer[read_pos] lines up with audio_mix_position
+	int fill;
+	AudioSourceStats stats;
+};
+
+// Encoded packets of one stream waiting to be interleaved with the other, oldest first
+struct PacketQueue {
+	AVPacket packets[INTERLEAVE_MAX_PACKETS];
+	int head;
+	int count;
+	unsigned long bytes;
+};
+
 class VideoRecorderImpl : public VideoRecorder {
 public:
 	VideoRecorderImpl();
@@ -30,6 +269,8 @@ public:
 	
 	bool SetVideoOptions(VideoFrameFormat fmt, int width, int height, unsigned long bitrate);
 	bool SetAudioOptions(AudioSampleFormat fmt, int channels, unsigned long samplerate, unsigned long bitrate);
+	bool SetInterleaveOptions(unsigned long maxBytes, unsigned long maxDelayMs, InterleaveOverflowPolicy policy);
+	bool SetThumbnailOptions(ThumbnailFormat fmt, int width, int height, unsigned long intervalMs, bool onKeyframes, ThumbnailCallback callback, void *userdata, const char *thumbfile);
 
 	bool Open(const char *mp4file, bool hasAudio, bool dbg);
 	bool Close();
@@ -37,17 +278,48 @@ public:
 	bool Start();
 
 	void SupplyVideoFrame(const void *frame, unsigned long numBytes, unsigned long timestamp);
+	void SupplyVideoFrame(const void * const planes[], const int strides[], int numPlanes, unsigned long timestamp);
+	void SupplyVideoFrames(const VideoFrame *frames, int numFrames);
+	
 	void SupplyAudioSamples(const void *samples, unsigned long numSamples);
 
+	int AddAudioSource(AudioSampleFormat fmt, int channels, float gain);
+	bool SetAudioSourceGain(int source, float gain);
+	void SupplyAudioSamples(int source, const void *samples, unsigned long numSamples, unsigned long timestamp);
+	bool GetAudioSourceStats(int source, AudioSourceStats *stats);
+	
+	bool GetStats(RecorderStats *stats);
+	
+	bool SetCaptureFile(const char *capturefile);
+	bool SetTraceFile(const char *jsonfile);
+	bool DumpTrace(const char *jsonfile);
+
 private:	
 	AVStream *add_audio_stream(enum CodecID codec_id);
 	void open_audio();	
-	void write_audio_frame(AVStream *st);
+	bool write_audio_frame(AVStream *st);
+	void push_audio_source(AudioSource *src, const uint8_t *data, int numSamples);
+	void mix_audio_frame(bool flushing);
 	
 	AVStream *add_video_stream(enum CodecID codec_id);
 	AVFrame *alloc_picture(enum PixelFormat pix_fmt, int width, int height);
 	void open_video();
-	void write_video_frame(AVStream *st);
+	void write_video_frame(unsigned long timestamp);
+	unsigned long clock_base(unsigned long timestamp);
+	
+	bool interleave_packet(AVPacket *pkt);
+	bool interleave_write(bool flushAll);
+	bool interleave_overflowed();
+	int64_t queued_packet_time(int stream, int n);
+	
+	bool open_capture(bool hasAudio);
+	void capture_record(CaptureRecordType type, const void *fields, int fieldsSize, const void * const data[], const unsigned long sizes[], int numData);
+	
+	bool open_thumbnails();
+	void close_thumbnails();
+	void queue_thumbnail(AVFrame *frame, unsigned long timestamp, bool keyframe);
+	void make_thumbnail();
+	static void *thumbnail_thread(void *arg);
 	
 	// audio related vars
 	int16_t *samples;
@@ -63,6 +335,14 @@ private:
 	unsigned long audio_sample_rate;		// number of samples per second
 	int audio_sample_size;					// size of each sample in bytes (16-bit = 2)
 	AVSampleFormat audio_sample_format;
+	int64_t audio_next_pts;					// pts of the next audio packet in samples, on the same clock as the video pts
+	bool audio_started;						// audio_next_pts has been lined up with the video clock
+	
+	// audio mixer vars
+	AudioSource audio_sources[MAX_AUDIO_SOURCES];
+	int num_audio_sources;
+	int64_t audio_mix_position;				// position (in samples) of the next frame to be mixed, relative to timestamp_base
+	pthread_mutex_t audio_lock;				// sources are usually supplied from different threads (microphone, app audio)
 		
 	// video related vars
 	uint8_t *video_outbuf;
@@ -74,10 +354,61 @@ private:
 	unsigned long video_bitrate;
 	PixelFormat video_pixfmt;
 	AVFrame *picture;			// video frame after being converted to x264-friendly YUV420P
-	AVFrame *tmp_picture;		// video frame before conversion (RGB565)
+	AVFrame *tmp_picture;		// video frame before conversion, pointing at the caller's buffers
 	SwsContext *img_convert_ctx;
 	
-	unsigned long timestamp_base;
+	volatile unsigned long timestamp_base;	// caller timestamp that pts 0 corresponds to, for both audio and video
+	volatile unsigned long video_last_timestamp;	// of the last video frame, to line up the single stream audio
+	
+	// interleaver vars
+	PacketQueue interleave_queues[2];		// indexed by stream index
+	unsigned long interleave_max_bytes;
+	int64_t interleave_max_delay;			// microseconds
+	InterleaveOverflowPolicy interleave_policy;
+	unsigned long interleave_bytes;
+	unsigned long interleave_peak_bytes;
+	unsigned long interleave_overflows;
+	unsigned long interleave_dropped;
+	bool interleave_skip_video;				// a video packet was dropped, drop the rest up to the next keyframe
+	pthread_mutex_t interleave_lock;		// audio and video may be supplied from different threads
+	
+	// thumbnail related vars
+	ThumbnailFormat thumb_format;
+	int thumb_width;
+	int thumb_height;
+	unsigned long thumb_interval;
+	bool thumb_on_keyframe;
+	ThumbnailCallback thumb_callback;
+	void *thumb_userdata;
+	char *thumb_filename;		// our own copy, the caller's string may be gone by Open
+	FILE *thumb_file;
+	bool thumb_started;
+	unsigned long thumb_next_timestamp;
+	AVFrame *thumb_source;		// copy of the encoded YUV frame handed to the thumbnail thread
+	AVFrame *thumb_picture;		// downscaled YUV420P
+	AVFrame *thumb_rgba;		// thumb_picture converted to RGBA when requested
+	SwsContext *thumb_convert_ctx;
+	uint32_t *thumb_rowsum;
+	unsigned long thumb_skipped;	// thumbnails skipped because the thread was still busy with the last one
+	
+	pthread_t thumb_thread;
+	pthread_mutex_t thumb_lock;
+	pthread_cond_t thumb_cond;
+	bool thumb_thread_running;
+	bool thumb_pending;			// thumb_source holds a frame the thread hasn't processed yet
+	bool thumb_quit;
+	unsigned long thumb_pending_timestamp;
+	bool thumb_pending_keyframe;
+	
+	char *trace_filename;			// trace dumped here on Close, our own copy
+	
+	// capture related vars
+	VideoFrameFormat capture_video_format;		// as passed to SetVideoOptions/SetAudioOptions, for the capture file header
+	AudioSampleFormat capture_audio_format;
+	char *capture_filename;			// our own copy
+	FILE *capture_file;
+	int64_t capture_start_time;
+	pthread_mutex_t capture_lock;
 	
 	// common
 	AVFormatContext *oc;
@@ -101,6 +432,11 @@ VideoRecorderImpl::VideoRecorderImpl()
 
 	audio_input_leftover_samples = 0;
 
+	num_audio_sources = 0;
+	audio_mix_position = 0;
+	audio_started = false;
+	pthread_mutex_init(&audio_lock, NULL);
+
 	video_outbuf = NULL;
 	video_st = NULL;
 
@@ -108,18 +444,57 @@ VideoRecorderImpl::VideoRecorderImpl()
 	tmp_picture = NULL;
 	img_convert_ctx = NULL;
 
+	thumb_format = ThumbnailFormatI420;
+	thumb_width = 0;
+	thumb_height = 0;
+	thumb_interval = 0;
+	thumb_on_keyframe = false;
+	thumb_callback = NULL;
+	thumb_userdata = NULL;
+	thumb_filename = NULL;
+	thumb_file = NULL;
+	thumb_source = NULL;
+	thumb_picture = NULL;
+	thumb_rgba = NULL;
+	thumb_convert_ctx = NULL;
+	thumb_rowsum = NULL;
+	thumb_thread_running = false;
+
+	trace_filename = NULL;
+
+	memset(interleave_queues, 0, sizeof(interleave_queues));
+	interleave_max_bytes = INTERLEAVE_DEFAULT_BYTES;
+	interleave_max_delay = INTERLEAVE_DEFAULT_DELAY_MS * 1000;
+	interleave_policy = InterleaveOverflowFlush;
+	interleave_bytes = 0;
+	interleave_peak_bytes = 0;
+	interleave_overflows = 0;
+	interleave_dropped = 0;
+	interleave_skip_video = false;
+	pthread_mutex_init(&interleave_lock, NULL);
+
+	capture_filename = NULL;
+	capture_file = NULL;
+	pthread_mutex_init(&capture_lock, NULL);
+
 	oc = NULL;
 }
 
 VideoRecorderImpl::~VideoRecorderImpl()
 {
-	
+	pthread_mutex_destroy(&audio_lock);
+	pthread_mutex_destroy(&interleave_lock);
+	pthread_mutex_destroy(&capture_lock);
 }
 
 bool VideoRecorderImpl::Open(const char *mp4file, bool hasAudio, bool dbg)
 {	
 	av_register_all();
 	
+#ifdef AVR_TRACE
+	trace_start_time = monotonic_time();
+#endif
+	
 	avformat_alloc_output_context2(&oc, NULL, NULL, mp4file);
 	if (!oc) {
 		LOGE("could not deduce output format from file extension\n");
@@ -136,6 +511,9 @@ bool VideoRecorderImpl::Open(const char *mp4file, bool hasAudio, bool dbg)
 	
 	open_video();
 	
+	if(thumb_width && !open_thumbnails())
+		return false;
+	
 	if(hasAudio)
 		open_audio();
 	
@@ -146,6 +524,9 @@ bool VideoRecorderImpl::Open(const char *mp4file, bool hasAudio, bool dbg)
 	
 	av_write_header(oc);
 	
+	if(capture_filename && !open_capture(hasAudio))
+		return false;
+	
 	return true;
 }
 
@@ -200,6 +581,8 @@ void VideoRecorderImpl::open_audio()
 	samples = (int16_t *)av_malloc(audio_input_frame_size * audio_sample_size * c->channels);
 	
 	audio_input_leftover_samples = 0;
+	audio_next_pts = 0;
+	audio_started = false;
 }
 
 AVStream *VideoRecorderImpl::add_video_stream(enum CodecID codec_id)
@@ -324,6 +707,7 @@ void VideoRecorderImpl::open_video()
 	AVCodecContext *c;
 
 	timestamp_base = 0;
+	video_last_timestamp = 0;
 	
 	if(!video_st) {
 		LOGE("tried to open_video without a valid video_st (add_video_stream must have failed)\n");
@@ -367,20 +751,14 @@ void VideoRecorderImpl::open_video()
 		return;
 	}*/
 	// Instead of allocating the video frame buffer and attaching it tmp_picture, thereby incurring an unnecessary memcpy() in SupplyVideoFrame,
-	// we only allocate the tmp_picture structure and set it up with default values. tmp_picture->data[0] is then reassigned to the incoming
-	// frame data on the SupplyVideoFrame() call.
+	// we only allocate the tmp_picture structure and set it up with default values. tmp_picture's data and linesize are then pointed at the
+	// incoming frame's planes on the SupplyVideoFrame() call.
 	tmp_picture = avcodec_alloc_frame();
 	if(!tmp_picture) {
 		LOGE("Could not allocate temporary picture\n");
 		return;
 	}
 	
-	if(video_pixfmt != PIX_FMT_RGB565LE) {
-		LOGE("We've hardcoded linesize in tmp_picture for PIX_FMT_RGB565LE only!!\n");
-		return;
-	}
-	tmp_picture->linesize[0] = c->width * 2;	// fix the linesize for tmp_picture (assuming RGB565)
-	
 	img_convert_ctx = sws_getContext(video_width, video_height, video_pixfmt, c->width, c->height, PIX_FMT_YUV420P, /*SWS_BICUBIC*/SWS_FAST_BILINEAR, NULL, NULL, NULL);
 	if(img_convert_ctx==NULL) {
 		LOGE("Could not initialize sws context\n");
@@ -391,7 +769,21 @@ void VideoRecorderImpl::open_video()
 bool VideoRecorderImpl::Close()
 {
 	if(oc) {
+		// mix out whatever the audio sources still have buffered
+		pthread_mutex_lock(&audio_lock);
+		for(;;) {
+			int i;
+			for(i = 0; i < num_audio_sources; i++)
+				if(audio_sources[i].fill)
+					break;
+			if(i == num_audio_sources)
+				break;
+			mix_audio_frame(true);
+		}
+		pthread_mutex_unlock(&audio_lock);
+		
 		// flush out delayed frames
+		TRACE_SCOPE("flush", AV_NOPTS_VALUE);
 		AVPacket pkt;
 		int out_size;
 		AVCodecContext *c = video_st->codec;
@@ -402,12 +794,13 @@ bool VideoRecorderImpl::Close()
 			if (c->coded_frame->pts != AV_NOPTS_VALUE)
 				pkt.pts = av_rescale_q(c->coded_frame->pts, c->time_base, video_st->time_base);
 		
+			pkt.dts = pkt.pts;	// no B-frames
 			pkt.flags |= AV_PKT_FLAG_KEY;
 			pkt.stream_index = video_st->index;
 			pkt.data = video_outbuf;
 			pkt.size = out_size;
 		
-			if(av_interleaved_write_frame(oc, &pkt) != 0) {
+			if(!interleave_packet(&pkt)) {
 				LOGE("Unable to write video frame when flushing delayed frames\n");
 				return false;
 			}
@@ -416,9 +809,31 @@ bool VideoRecorderImpl::Close()
 			}
 		}
 		
+		pthread_mutex_lock(&interleave_lock);
+		bool flushed = interleave_write(true);
+		pthread_mutex_unlock(&interleave_lock);
+		if(!flushed) {
+			LOGE("Unable to write queued packets\n");
+			return false;
+		}
+		
 		av_write_trailer(oc);
 	}
 	
+	close_thumbnails();
+	
+	if(capture_file) {
+		if(fclose(capture_file) != 0)
+			LOGE("could not finish writing capture file '%s'\n", capture_filename);
+		capture_file = NULL;
+	}
+	av_freep(&capture_filename);
+	
+	if(trace_filename) {
+		DumpTrace(trace_filename);
+		av_freep(&trace_filename);
+	}
+	
 	if(video_st)
 		avcodec_close(video_st->codec);
 	
@@ -445,10 +860,25 @@ bool VideoRecorderImpl::Close()
 		
 	if(samples)
 		av_free(samples);
+	
+	for(int i = 0; i < num_audio_sources; i++)
+		av_free(audio_sources[i].buffer);
+	num_audio_sources = 0;
 		
 	if(audio_outbuf)
 		av_free(audio_outbuf);
 	
+	// anything still queued couldn't be written
+	for(int i = 0; i < 2; i++) {
+		PacketQueue *q = &interleave_queues[i];
+		for(; q->count; q->count--) {
+			av_free_packet(&q->packets[q->head]);
+			q->head = (q->head + 1) % INTERLEAVE_MAX_PACKETS;
+		}
+		q->bytes = 0;
+	}
+	interleave_bytes = 0;
+	
 	if(oc) {
 		for(int i = 0; i < oc->nb_streams; i++) {
 			av_freep(&oc->streams[i]->codec);
@@ -457,29 +887,42 @@ bool VideoRecorderImpl::Close()
 		avio_close(oc->pb);
 		av_free(oc);
 	}
+	
+	return true;
 }
 
-bool VideoRecorderImpl::SetVideoOptions(VideoFrameFormat fmt, int width, int height, unsigned long bitrate)
+// also used by the replay tool to check captured frames
+static bool video_frame_pixfmt(VideoFrameFormat fmt, PixelFormat *pixfmt)
 {
 	switch(fmt) {
-		case VideoFrameFormatYUV420P: video_pixfmt=PIX_FMT_YUV420P; break;
-		case VideoFrameFormatNV12: video_pixfmt=PIX_FMT_NV12; break;
-		case VideoFrameFormatNV21: video_pixfmt=PIX_FMT_NV21; break;
-		case VideoFrameFormatRGB24: video_pixfmt=PIX_FMT_RGB24; break;
-		case VideoFrameFormatBGR24: video_pixfmt=PIX_FMT_BGR24; break;
-		case VideoFrameFormatARGB: video_pixfmt=PIX_FMT_ARGB; break;
-		case VideoFrameFormatRGBA: video_pixfmt=PIX_FMT_RGBA; break;
-		case VideoFrameFormatABGR: video_pixfmt=PIX_FMT_ABGR; break;
-		case VideoFrameFormatBGRA: video_pixfmt=PIX_FMT_BGRA; break;
-		case VideoFrameFormatRGB565LE: video_pixfmt=PIX_FMT_RGB565LE; break;
-		case VideoFrameFormatRGB565BE: video_pixfmt=PIX_FMT_RGB565BE; break;
-		case VideoFrameFormatBGR565LE: video_pixfmt=PIX_FMT_BGR565LE; break;
-		case VideoFrameFormatBGR565BE: video_pixfmt=PIX_FMT_BGR565BE; break;
-		default: LOGE("Unknown frame format passed to SetVideoOptions!\n"); return false;
+		case VideoFrameFormatYUV420P: *pixfmt=PIX_FMT_YUV420P; break;
+		case VideoFrameFormatNV12: *pixfmt=PIX_FMT_NV12; break;
+		case VideoFrameFormatNV21: *pixfmt=PIX_FMT_NV21; break;
+		case VideoFrameFormatRGB24: *pixfmt=PIX_FMT_RGB24; break;
+		case VideoFrameFormatBGR24: *pixfmt=PIX_FMT_BGR24; break;
+		case VideoFrameFormatARGB: *pixfmt=PIX_FMT_ARGB; break;
+		case VideoFrameFormatRGBA: *pixfmt=PIX_FMT_RGBA; break;
+		case VideoFrameFormatABGR: *pixfmt=PIX_FMT_ABGR; break;
+		case VideoFrameFormatBGRA: *pixfmt=PIX_FMT_BGRA; break;
+		case VideoFrameFormatRGB565LE: *pixfmt=PIX_FMT_RGB565LE; break;
+		case VideoFrameFormatRGB565BE: *pixfmt=PIX_FMT_RGB565BE; break;
+		case VideoFrameFormatBGR565LE: *pixfmt=PIX_FMT_BGR565LE; break;
+		case VideoFrameFormatBGR565BE: *pixfmt=PIX_FMT_BGR565BE; break;
+		default: return false;
+	}
+	return true;
+}
+
+bool VideoRecorderImpl::SetVideoOptions(VideoFrameFormat fmt, int width, int height, unsigned long bitrate)
+{
+	if(!video_frame_pixfmt(fmt, &video_pixfmt)) {
+		LOGE("Unknown frame format passed to SetVideoOptions!\n");
+		return false;
 	}
 	video_width = width;
 	video_height = height;
 	video_bitrate = bitrate;
+	capture_video_format = fmt;
 	return true;
 }
 
@@ -496,6 +939,7 @@ bool VideoRecorderImpl::SetAudioOptions(AudioSampleFormat fmt, int channels, uns
 	audio_channels = channels;
 	audio_bit_rate = bitrate;
 	audio_sample_rate = samplerate;
+	capture_audio_format = fmt;
 	return true;
 }
 
@@ -511,6 +955,25 @@ void VideoRecorderImpl::SupplyAudioSamples(const void *sampleData, unsigned long
 		LOGE("tried to supply an audio frame when no audio stream was present\n");
 		return;
 	}
+	
+	if(num_audio_sources) {
+		LOGE("tried to supply single stream audio samples while audio sources are being mixed\n");
+		return;
+	}
+	
+	if(capture_file) {
+		CaptureAudioSamplesFields fields = { numSamples };
+		unsigned long size = numSamples * audio_sample_size * audio_channels;
+		capture_record(CaptureAudioSamples, &fields, sizeof(fields), &sampleData, &size, 1);
+	}
+	
+	if(!audio_started) {
+		// these samples carry no timestamp, so start them at the last video frame. Audio that
+		// starts before the video is taken to start with the first video frame.
+		if(video_last_timestamp)
+			audio_next_pts = ((int64_t)video_last_timestamp - (int64_t)clock_base(video_last_timestamp)) * audio_sample_rate / 1000;
+		audio_started = true;
+	}
 		
 	AVCodecContext *c = audio_st->codec;
 
@@ -519,9 +982,6 @@ void VideoRecorderImpl::SupplyAudioSamples(const void *sampleData, unsigned long
 	// numSamples is supplied by the codec.. should be c->frame_size (1024 for AAC)
 	// if it's more we go through it c->frame_size samples at a time
 	while(numSamples) {
-		static AVPacket pkt;
-		av_init_packet(&pkt);	// need to init packet every time so all the values (such as pts) are re-initialized
-		
 		// if we have enough samples for a frame, we write out c->frame_size number of samples (ie: one frame) to the output context
 		if( (numSamples + audio_input_leftover_samples) >= c->frame_size) {
 			// audio_input_leftover_samples contains the number of samples already in our "samples" array, left over from last time
@@ -533,18 +993,8 @@ void VideoRecorderImpl::SupplyAudioSamples(const void *sampleData, unsigned long
 			samplePtr += (num_new_samples * audio_sample_size * audio_channels);
 			audio_input_leftover_samples = 0;
 			
-			pkt.flags |= AV_PKT_FLAG_KEY;
-			pkt.stream_index = audio_st->index;
-			pkt.data = audio_outbuf;
-			pkt.size = avcodec_encode_audio(c, audio_outbuf, audio_outbuf_size, samples);
-
-			if (c->coded_frame && c->coded_frame->pts != AV_NOPTS_VALUE)
-				pkt.pts = av_rescale_q(c->coded_frame->pts, c->time_base, audio_st->time_base);
-
-			if(av_interleaved_write_frame(oc, &pkt) != 0) {
-				LOGE("Error while writing audio frame\n");
+			if(!write_audio_frame(audio_st))
 				return;
-			}
 		}
 		else {
 			// if we didn't have enough samples for a frame, we copy over however many we had and update audio_input_leftover_samples
@@ -560,160 +1010,1532 @@ void VideoRecorderImpl::SupplyAudioSamples(const void *sampleData, unsigned long
 	}
 }
 
-void VideoRecorderImpl::SupplyVideoFrame(const void *frameData, unsigned long numBytes, unsigned long timestamp)
+// encodes the frame in "samples" and writes it to the output context
+bool VideoRecorderImpl::write_audio_frame(AVStream *st)
 {
-	if(!video_st) {
-		LOGE("tried to SupplyVideoFrame when no video stream was present\n");
-		return;
-	}
-
-	AVCodecContext *c = video_st->codec;
-	
-	//memcpy(tmp_picture->data[0], frameData, numBytes);
-	// Don't copy the frame unnecessarily! Simply point tmp_picture->data[0] to the incoming frame
-	tmp_picture->data[0]=(uint8_t*)frameData;
-	
-	// if the input pixel format is not YUV420P, we'll assume
-	// it's stored in tmp_picture, so we'll convert it to YUV420P
-	// and store it in "picture"
-	// if it's already in YUV420P format we'll assume it's stored in
-	// "picture" from before
-	if(video_pixfmt != PIX_FMT_YUV420P) {
-		sws_scale(img_convert_ctx, tmp_picture->data, tmp_picture->linesize, 0, video_height, picture->data, picture->linesize);
-	}
+	AVCodecContext *c = st->codec;
+	AVPacket pkt;
+	av_init_packet(&pkt);
 	
-	if(timestamp_base == 0)
-		timestamp_base = timestamp;
+	pkt.flags |= AV_PKT_FLAG_KEY;
+	pkt.stream_index = st->index;
+	pkt.data = audio_outbuf;
 	
-	picture->pts = 90 * (timestamp - timestamp_base);	// assuming millisecond timestamp and 90 kHz timebase
+	// libfaac often leaves coded_frame->pts unset, but every packet holds exactly one frame
+	// of samples, so we count them instead
+	AVRational sample_time_base = { 1, (int)audio_sample_rate };
+	int64_t pts = av_rescale_q(audio_next_pts, sample_time_base, st->time_base);
+	{
+		TRACE_SCOPE("encode_audio", pts);
+		pkt.size = avcodec_encode_audio(c, audio_outbuf, audio_outbuf_size, samples);
+	}
 	
-	int out_size = avcodec_encode_video(c, video_outbuf, video_outbuf_size, picture);
-	LOG("avcodec_encode_video returned %d\n", out_size);
+	if(pkt.size < 0) {
+		LOGE("Error while encoding audio frame\n");
+		return false;
+	}
 	
-	if(out_size > 0) {
-		static AVPacket pkt;
-		
-		av_init_packet(&pkt);
-		
-		if (c->coded_frame->pts != AV_NOPTS_VALUE)
-			pkt.pts = av_rescale_q(c->coded_frame->pts, c->time_base, video_st->time_base);
+	// the encoder is still filling its delay line
+	if(pkt.size == 0)
+		return true;
 
-		if(c->coded_frame->key_frame)
-			pkt.flags |= AV_PKT_FLAG_KEY;
+	pkt.pts = pkt.dts = pts;
+	audio_next_pts += audio_input_frame_size;
 
-		pkt.stream_index = video_st->index;
-		pkt.data = video_outbuf;
-		pkt.size = out_size;
-		
-		if(av_interleaved_write_frame(oc, &pkt) != 0) {
-			LOGE("Unable to write video frame\n");
-			return;
-		}
+	TRACE_SCOPE("write_audio", pkt.pts);
+	if(!interleave_packet(&pkt)) {
+		LOGE("Error while writing audio frame\n");
+		return false;
 	}
+	return true;
 }
 
-VideoRecorder* VideoRecorder::New()
-{
-	return (VideoRecorder*)(new VideoRecorderImpl);
-}
-
-} // namespace AVR
-
-#ifdef TESTING
-
-float t = 0;
-float tincr = 2 * M_PI * 110.0 / 44100;
-float tincr2 = 2 * M_PI * 110.0 / 44100 / 44100;
+#if defined(ANDROID) && defined(__arm__)
+// in VideoRecorderNeon.cpp, which is built with -mfpu=neon
+int mix_samples_s16_neon(int16_t *dst, const int16_t *src, int count);
+#endif
 
-void fill_audio_frame(int16_t *samples, int frame_size, int nb_channels)
+// dst[i] = dst[i] + src[i], saturated to the S16 range
+static void mix_samples_s16(int16_t *dst, const int16_t *src, int count)
 {
-	int j, i, v;
-	int16_t *q;
-
-	q = samples;
-	for (j = 0; j < frame_size; j++) {
-		v = (int)(sin(t) * 10000);
-		for(i = 0; i < nb_channels; i++)
-			*q++ = v;
-		t += tincr;
-		tincr += tincr2;
+	int i = 0;
+#if defined(ANDROID) && defined(__arm__)
+	// the library targets ARMv7 without NEON (e.g. Tegra 2), so check for it at runtime
+	if(android_getCpuFamily() == ANDROID_CPU_FAMILY_ARM && (android_getCpuFeatures() & ANDROID_CPU_ARM_FEATURE_NEON))
+		i = mix_samples_s16_neon(dst, src, count);
+#elif defined(__SSE2__)
+	for(; i + 8 <= count; i += 8) {
+		__m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+		__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+		_mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+	}
+#endif
+	for(; i < count; i++) {
+		int v = dst[i] + src[i];
+		dst[i] = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
 	}
 }
 
-void fill_yuv_image(AVFrame *pict, int frame_index, int width, int height)
+// float samples are clamped to [-1, 1] before the cast, out of range values (or NaN) don't fit in an int
+static inline int float_sample_to_s16(double v)
 {
-	int x, y, i;
-
-	i = frame_index;
+	if(v != v)
+		return 0;
+	if(v > 1.0)
+		v = 1.0;
+	else if(v < -1.0)
+		v = -1.0;
+	return (int)(v * 32767.0);
+}
 
-	/* Y */
-	for (y = 0; y < height; y++) {
-		for (x = 0; x < width; x++) {
-			pict->data[0][y * pict->linesize[0] + x] = x + y + i * 3;
+// converts count interleaved samples to S16. The format is picked once, so each loop is a plain
+// array walk the compiler can vectorise.
+static void samples_to_s16(int16_t *out, const uint8_t *in, AVSampleFormat fmt, int count)
+{
+	switch(fmt) {
+		case AV_SAMPLE_FMT_U8:
+			for(int i = 0; i < count; i++)
+				out[i] = ((int)in[i] - 128) * 256;
+			break;
+		case AV_SAMPLE_FMT_S16:
+			memcpy(out, in, count * sizeof(int16_t));
+			break;
+		case AV_SAMPLE_FMT_S32: {
+			const int32_t *p = (const int32_t *)in;
+			for(int i = 0; i < count; i++)
+				out[i] = p[i] >> 16;
+			break;
 		}
-	}
-
-	/* Cb and Cr */
-	for (y = 0; y < height/2; y++) {
-		for (x = 0; x < width/2; x++) {
-			pict->data[1][y * pict->linesize[1] + x] = 128 + y + i * 2;
-			pict->data[2][y * pict->linesize[2] + x] = 64 + x + i * 5;
+		case AV_SAMPLE_FMT_FLT: {
+			const float *p = (const float *)in;
+			for(int i = 0; i < count; i++)
+				out[i] = float_sample_to_s16(p[i]);
+			break;
 		}
+		case AV_SAMPLE_FMT_DBL: {
+			const double *p = (const double *)in;
+			for(int i = 0; i < count; i++)
+				out[i] = float_sample_to_s16(p[i]);
+			break;
+		}
+		default:
+			memset(out, 0, count * sizeof(int16_t));
+			break;
 	}
 }
 
-#define RGB565(r,g,b) (uint16_t)( ((red & 0x1F) << 11) | ((green & 0x3F) << 5) | (blue & 0x1F) ) 
+// scales count S16 samples by a 4.12 fixed point gain, saturating
+static void apply_gain_s16(int16_t *samples, int count, int gain)
+{
+	for(int i = 0; i < count; i++) {
+		int v = (samples[i] * gain) / AUDIO_GAIN_UNITY;
+		samples[i] = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+	}
+}
 
-void fill_rgb_image(uint8_t *pixels, int i, int width, int height)
-{	
-	int x, y;
-	
-	for(y = 0; y < height; y++) {
-		for(x = 0; x < width; x++) {
+// converts numSamples samples from the source's format and channel layout to S16 with outChannels channels, applying gain
+static void convert_audio_samples(int16_t *out, int outChannels, const uint8_t *in, AVSampleFormat fmt, int sampleSize, int inChannels, int gain, int numSamples)
+{
+	if(inChannels == outChannels) {
+		samples_to_s16(out, in, fmt, numSamples * outChannels);
+	}
+	else {
+		// convert a chunk at a time into S16, then remap the channels
+		int16_t tmp[AUDIO_CONVERT_CHUNK];
+		int chunk = AUDIO_CONVERT_CHUNK / inChannels;
+		for(int done = 0; done < numSamples; done += chunk) {
+			int n = numSamples - done < chunk ? numSamples - done : chunk;
+			samples_to_s16(tmp, in + done * inChannels * sampleSize, fmt, n * inChannels);
 			
-			uint8_t red = x + y + i * 3;
-			uint8_t green = x + y + i * 3;
-			uint8_t blue = x + y + i * 3;
-
-			uint16_t pixel = RGB565(red, green, blue);
-
-			// assume linesize is width*2
-			pixels[y * (width*2) + x*2 + 0] = (uint8_t)(pixel);		// lower order bits
-			pixels[y * (width*2) + x*2 + 1] = (uint8_t)(pixel >> 8);	// higher order bits
+			int16_t *o = out + done * outChannels;
+			if(outChannels == 1) {
+				// downmix to mono
+				for(int i = 0; i < n; i++) {
+					int v = 0;
+					for(int j = 0; j < inChannels; j++)
+						v += tmp[i * inChannels + j];
+					o[i] = v / inChannels;
+				}
+			}
+			else {
+				for(int i = 0; i < n; i++)
+					for(int ch = 0; ch < outChannels; ch++)
+						o[i * outChannels + ch] = tmp[i * inChannels + (ch % inChannels)];
+			}
 		}
 	}
+	
+	if(gain != AUDIO_GAIN_UNITY)
+		apply_gain_s16(out, numSamples * outChannels, gain);
 }
 
-#include <iostream>
-
-int main()
+static int audio_gain_to_fixed(float gain)
 {
-	AVR::VideoRecorder *recorder = new AVR::VideoRecorderImpl();
-
-	recorder->SetAudioOptions(AVR::AudioSampleFormatS16, 2, 44100, 64000);
-	recorder->SetVideoOptions(AVR::VideoFrameFormatRGB565LE, 640, 480, 400000);
-	recorder->Open("testing.mp4", true, true);
-
-	int16_t *sound_buffer = new int16_t[2048 * 2];
-	uint8_t *video_buffer = new uint8_t[640 * 480 * 2];
-	for(int i = 0; i < 200; i++) {
-		fill_audio_frame(sound_buffer, 900, 2);
-		recorder->SupplyAudioSamples(sound_buffer, 900);
+	if(gain < 0.0f) gain = 0.0f;
+	if(gain > 8.0f) gain = 8.0f;
+	return (int)(gain * AUDIO_GAIN_UNITY + 0.5f);
+}
 
-		fill_rgb_image(video_buffer, i, 640, 480);
-		recorder->SupplyVideoFrame(video_buffer, 640*480*2, (25 * i)+1);
+int VideoRecorderImpl::AddAudioSource(AudioSampleFormat fmt, int channels, float gain)
+{
+	if(audio_st == NULL || samples == NULL) {
+		LOGE("tried to add an audio source without an open audio stream\n");
+		return -1;
 	}
 	
-	delete video_buffer;
-	delete sound_buffer;
-
-	recorder->Close();
-
-	std::cout << "Done" << std::endl;
-
-	delete recorder;
+	if(audio_sample_format != AV_SAMPLE_FMT_S16) {
+		LOGE("audio sources can only be mixed into an S16 audio stream\n");
+		return -1;
+	}
 	
-	return 0;
-}
-
+	if(channels < 1 || channels > MAX_AUDIO_SOURCE_CHANNELS) {
+		LOGE("invalid channel count passed to AddAudioSource\n");
+		return -1;
+	}
+	
+	AVSampleFormat sample_format;
+	int sample_size;
+	switch(fmt) {
+		case AudioSampleFormatU8: sample_format=AV_SAMPLE_FMT_U8; sample_size=1; break;
+		case AudioSampleFormatS16: sample_format=AV_SAMPLE_FMT_S16; sample_size=2; break;
+		case AudioSampleFormatS32: sample_format=AV_SAMPLE_FMT_S32; sample_size=4; break;
+		case AudioSampleFormatFLT: sample_format=AV_SAMPLE_FMT_FLT; sample_size=4; break;
+		case AudioSampleFormatDBL: sample_format=AV_SAMPLE_FMT_DBL; sample_size=8; break;
+		default: LOGE("Unknown sample format passed to AddAudioSource!\n"); return -1;
+	}
+	
+	int16_t *buffer = (int16_t *)av_malloc(audio_input_frame_size * AUDIO_SOURCE_JITTER_FRAMES * audio_channels * sizeof(int16_t));
+	if(!buffer) {
+		LOGE("could not allocate audio source buffer\n");
+		return -1;
+	}
+	
+	pthread_mutex_lock(&audio_lock);
+	
+	if(num_audio_sources == MAX_AUDIO_SOURCES) {
+		pthread_mutex_unlock(&audio_lock);
+		av_free(buffer);
+		LOGE("too many audio sources\n");
+		return -1;
+	}
+	
+	AudioSource *src = &audio_sources[num_audio_sources];
+	memset(src, 0, sizeof(*src));
+	src->sample_format = sample_format;
+	src->sample_size = sample_size;
+	src->channels = channels;
+	src->gain = audio_gain_to_fixed(gain);
+	src->capacity = audio_input_frame_size * AUDIO_SOURCE_JITTER_FRAMES;
+	src->buffer = buffer;
+	
+	// only sources that were added, so the replay hands out the same source ids
+	if(capture_file) {
+		CaptureAddAudioSourceFields fields = { fmt, channels, gain, 0 };
+		capture_record(CaptureAddAudioSource, &fields, sizeof(fields), NULL, NULL, 0);
+	}
+	
+	int source = num_audio_sources++;
+	pthread_mutex_unlock(&audio_lock);
+	return source;
+}
+
+bool VideoRecorderImpl::SetAudioSourceGain(int source, float gain)
+{
+	pthread_mutex_lock(&audio_lock);
+	if(source < 0 || source >= num_audio_sources) {
+		pthread_mutex_unlock(&audio_lock);
+		LOGE("invalid audio source %d\n", source);
+		return false;
+	}
+	audio_sources[source].gain = audio_gain_to_fixed(gain);
+	
+	if(capture_file) {
+		CaptureAudioSourceGainFields fields = { source, gain };
+		capture_record(CaptureAudioSourceGain, &fields, sizeof(fields), NULL, NULL, 0);
+	}
+	pthread_mutex_unlock(&audio_lock);
+	return true;
+}
+
+bool VideoRecorderImpl::GetAudioSourceStats(int source, AudioSourceStats *stats)
+{
+	pthread_mutex_lock(&audio_lock);
+	if(source < 0 || source >= num_audio_sources || !stats) {
+		pthread_mutex_unlock(&audio_lock);
+		LOGE("invalid audio source %d\n", source);
+		return false;
+	}
+	*stats = audio_sources[source].stats;
+	stats->buffered = audio_sources[source].fill;
+	pthread_mutex_unlock(&audio_lock);
+	return true;
+}
+
+// appends numSamples samples to a source's jitter buffer, or silence if data is NULL
+void VideoRecorderImpl::push_audio_source(AudioSource *src, const uint8_t *data, int numSamples)
+{
+	while(numSamples) {
+		if(src->fill == src->capacity) {
+			// this source is a whole jitter buffer ahead, stop waiting for the others
+			mix_audio_frame(false);
+			continue;
+		}
+		
+		int write_pos = (src->read_pos + src->fill) % src->capacity;
+		int n = numSamples;
+		if(n > src->capacity - src->fill)
+			n = src->capacity - src->fill;
+		if(n > src->capacity - write_pos)
+			n = src->capacity - write_pos;
+		
+		int16_t *out = src->buffer + write_pos * audio_channels;
+		if(data) {
+			convert_audio_samples(out, audio_channels, data, src->sample_format, src->sample_size, src->channels, src->gain, n);
+			data += n * src->sample_size * src->channels;
+		}
+		else {
+			memset(out, 0, n * audio_channels * sizeof(int16_t));
+		}
+		
+		src->fill += n;
+		numSamples -= n;
+	}
+}
+
+// mixes one encoder frame from every source into "samples" and encodes it
+void VideoRecorderImpl::mix_audio_frame(bool flushing)
+{
+	TRACE_SCOPE("mix_audio", AV_NOPTS_VALUE);
+	int frame_size = audio_input_frame_size;
+	
+	memset(samples, 0, frame_size * audio_channels * sizeof(int16_t));
+	
+	for(int i = 0; i < num_audio_sources; i++) {
+		AudioSource *src = &audio_sources[i];
+		int n = src->fill < frame_size ? src->fill : frame_size;
+		
+		if(n < frame_size && !flushing)
+			src->stats.underruns++;
+		
+		// the frame may wrap around the end of the ring buffer
+		int first = src->capacity - src->read_pos;
+		if(first > n)
+			first = n;
+		mix_samples_s16(samples, src->buffer + src->read_pos * audio_channels, first * audio_channels);
+		if(n > first)
+			mix_samples_s16(samples + first * audio_channels, src->buffer, (n - first) * audio_channels);
+		
+		src->read_pos = (src->read_pos + n) % src->capacity;
+		src->fill -= n;
+	}
+	
+	audio_mix_position += frame_size;
+	
+	write_audio_frame(audio_st);
+}
+
+void VideoRecorderImpl::SupplyAudioSamples(int source, const void *sampleData, unsigned long numSamples, unsigned long timestamp)
+{
+	if(audio_st == NULL) {
+		LOGE("tried to supply an audio frame when no audio stream was present\n");
+		return;
+	}
+	
+	// the sources may be supplied from different threads, and whichever one completes a frame mixes and encodes it
+	pthread_mutex_lock(&audio_lock);
+	
+	if(source < 0 || source >= num_audio_sources) {
+		pthread_mutex_unlock(&audio_lock);
+		LOGE("tried to supply audio samples for invalid audio source %d\n", source);
+		return;
+	}
+	
+	AudioSource *src = &audio_sources[source];
+	const uint8_t *samplePtr = (const uint8_t *)sampleData;
+	
+	if(capture_file) {
+		CaptureAudioSourceSamplesFields fields = { source, 0, numSamples, timestamp };
+		unsigned long size = numSamples * src->sample_size * src->channels;
+		capture_record(CaptureAudioSourceSamples, &fields, sizeof(fields), &sampleData, &size, 1);
+	}
+	
+	// line the samples up against what this source has delivered so far
+	int64_t position = ((int64_t)timestamp - (int64_t)clock_base(timestamp)) * audio_sample_rate / 1000;
+	
+	if(!audio_started) {
+		// start the mix where this audio sits on the video clock. When video arrived first and set
+		// the base, audio from before the first video frame is dropped as overlap below.
+		audio_mix_position = position > 0 ? position : 0;
+		audio_next_pts = audio_mix_position;
+		audio_started = true;
+	}
+	
+	int64_t expected = audio_mix_position + src->fill;
+	int64_t tolerance = (int64_t)audio_sample_rate * AUDIO_SOURCE_TOLERANCE_MS / 1000;
+	
+	if(position > expected + tolerance) {
+		// the source skipped some audio, pad the gap with silence so it stays aligned with the others
+		push_audio_source(src, NULL, (int)(position - expected));
+	}
+	else if(position + tolerance < expected) {
+		// these samples overlap audio we've already got for this source
+		int64_t overlap = expected - position;
+		if(overlap > (int64_t)numSamples)
+			overlap = numSamples;
+		src->stats.overruns += overlap;
+		numSamples -= overlap;
+		samplePtr += overlap * src->sample_size * src->channels;
+	}
+	
+	push_audio_source(src, samplePtr, numSamples);
+	
+	// mix as long as every source has a whole frame ready
+	for(;;) {
+		int i;
+		for(i = 0; i < num_audio_sources; i++)
+			if(audio_sources[i].fill < audio_input_frame_size)
+				break;
+		if(i < num_audio_sources)
+			break;
+		mix_audio_frame(false);
+	}
+	
+	pthread_mutex_unlock(&audio_lock);
+}
+
+// number of planes the caller supplies for a pixel format
+static int video_plane_count(PixelFormat fmt)
+{
+	switch(fmt) {
+		case PIX_FMT_YUV420P: return 3;
+		case PIX_FMT_NV12:
+		case PIX_FMT_NV21: return 2;
+		default: return 1;
+	}
+}
+
+// bytes of pixel data in each row of a plane, the caller's stride can't be any less
+static int video_plane_row_bytes(PixelFormat fmt, int width, int plane)
+{
+	switch(fmt) {
+		case PIX_FMT_YUV420P: return plane == 0 ? width : (width + 1) / 2;
+		case PIX_FMT_NV12:
+		case PIX_FMT_NV21: return plane == 0 ? width : (width + 1) / 2 * 2;		// interleaved chroma pairs
+		case PIX_FMT_RGB24:
+		case PIX_FMT_BGR24: return width * 3;
+		case PIX_FMT_ARGB:
+		case PIX_FMT_RGBA:
+		case PIX_FMT_ABGR:
+		case PIX_FMT_BGRA: return width * 4;
+		default: return width * 2;		// the 565 formats
+	}
+}
+
+// bytes a plane spans from its first pixel to its last. The chroma planes of YUV420P/NV12/NV21 have
+// half as many rows, and the last row needn't be padded out to the stride.
+static unsigned long video_plane_size(PixelFormat fmt, int width, int height, int plane, int stride)
+{
+	int rows = plane == 0 ? height : (height + 1) / 2;
+	return (unsigned long)stride * (rows - 1) + video_plane_row_bytes(fmt, width, plane);
+}
+
+void VideoRecorderImpl::SupplyVideoFrame(const void *frameData, unsigned long numBytes, unsigned long timestamp)
+{
+	if(!video_st) {
+		LOGE("tried to SupplyVideoFrame when no video stream was present\n");
+		return;
+	}
+	
+	if(!frameData) {
+		LOGE("video frame is NULL\n");
+		return;
+	}
+	
+	if(numBytes < (unsigned long)avpicture_get_size(video_pixfmt, video_width, video_height)) {
+		LOGE("video frame of %lu bytes is too small for the video format\n", numBytes);
+		return;
+	}
+	
+	if(capture_file) {
+		CaptureVideoFrameFields fields = { timestamp };
+		capture_record(CaptureVideoFrame, &fields, sizeof(fields), &frameData, &numBytes, 1);
+	}
+	
+	//memcpy(tmp_picture->data[0], frameData, numBytes);
+	// Don't copy the frame unnecessarily! Simply point tmp_picture's planes into the incoming frame
+	avpicture_fill((AVPicture *)tmp_picture, (uint8_t *)frameData, video_pixfmt, video_width, video_height);
+	
+	write_video_frame(timestamp);
+}
+
+void VideoRecorderImpl::SupplyVideoFrame(const void * const planes[], const int strides[], int numPlanes, unsigned long timestamp)
+{
+	if(!video_st) {
+		LOGE("tried to SupplyVideoFrame when no video stream was present\n");
+		return;
+	}
+	
+	if(!planes || !strides) {
+		LOGE("video frame has no planes\n");
+		return;
+	}
+	
+	if(numPlanes != video_plane_count(video_pixfmt)) {
+		LOGE("video frame has %d planes, the video format needs %d\n", numPlanes, video_plane_count(video_pixfmt));
+		return;
+	}
+	
+	// sws_scale and the encoder walk every row of every plane, so each row has to be there in full
+	for(int i = 0; i < numPlanes; i++) {
+		if(!planes[i]) {
+			LOGE("video plane %d is NULL\n", i);
+			return;
+		}
+		if(strides[i] < video_plane_row_bytes(video_pixfmt, video_width, i)) {
+			LOGE("video plane %d has a stride of %d, its rows are %d bytes\n", i, strides[i], video_plane_row_bytes(video_pixfmt, video_width, i));
+			return;
+		}
+	}
+	
+	if(capture_file) {
+		CaptureVideoPlanesFields fields;
+		unsigned long sizes[4];
+		memset(&fields, 0, sizeof(fields));
+		fields.timestamp = timestamp;
+		fields.num_planes = numPlanes;
+		for(int i = 0; i < numPlanes; i++) {
+			fields.strides[i] = strides[i];
+			fields.sizes[i] = sizes[i] = video_plane_size(video_pixfmt, video_width, video_height, i, strides[i]);
+		}
+		capture_record(CaptureVideoPlanes, &fields, sizeof(fields), planes, sizes, numPlanes);
+	}
+	
+	for(int i = 0; i < 4; i++) {
+		tmp_picture->data[i] = i < numPlanes ? (uint8_t *)planes[i] : NULL;
+		tmp_picture->linesize[i] = i < numPlanes ? strides[i] : 0;
+	}
+	
+	write_video_frame(timestamp);
+}
+
+void VideoRecorderImpl::SupplyVideoFrames(const VideoFrame *frames, int numFrames)
+{
+	if(!frames || numFrames < 0) {
+		LOGE("invalid video frames passed to SupplyVideoFrames\n");
+		return;
+	}
+	for(int i = 0; i < numFrames; i++)
+		SupplyVideoFrame(frames[i].planes, frames[i].strides, frames[i].numPlanes, frames[i].timestamp);
+}
+
+// the first timestamp supplied on either stream becomes pts 0. Audio and video may be supplied from
+// different threads, so only the first one to get here sets it.
+unsigned long VideoRecorderImpl::clock_base(unsigned long timestamp)
+{
+	unsigned long base = __sync_val_compare_and_swap(&timestamp_base, 0, timestamp);
+	return base ? base : timestamp;
+}
+
+// converts the frame in tmp_picture if needed, encodes it and writes it to the output context
+void VideoRecorderImpl::write_video_frame(unsigned long timestamp)
+{
+	AVCodecContext *c = video_st->codec;
+	AVFrame *frame = picture;
+	
+	int64_t pts = 90 * ((int64_t)timestamp - (int64_t)clock_base(timestamp));	// assuming millisecond timestamp and 90 kHz timebase
+	video_last_timestamp = timestamp;
+	
+	// if the input pixel format is not YUV420P we convert it to YUV420P
+	// and store it in "picture", otherwise we encode straight from the
+	// caller's planes in tmp_picture
+	if(video_pixfmt != PIX_FMT_YUV420P) {
+		TRACE_SCOPE("convert", pts);
+		sws_scale(img_convert_ctx, tmp_picture->data, tmp_picture->linesize, 0, video_height, picture->data, picture->linesize);
+	}
+	else {
+		frame = tmp_picture;
+	}
+	
+	frame->pts = pts;
+	
+	int out_size;
+	{
+		TRACE_SCOPE("encode_video", pts);
+		out_size = avcodec_encode_video(c, video_outbuf, video_outbuf_size, frame);
+	}
+	LOG("avcodec_encode_video returned %d\n", out_size);
+	
+	if(out_size > 0) {
+		static AVPacket pkt;
+		
+		av_init_packet(&pkt);
+		
+		if (c->coded_frame->pts != AV_NOPTS_VALUE)
+			pkt.pts = av_rescale_q(c->coded_frame->pts, c->time_base, video_st->time_base);
+
+		pkt.dts = pkt.pts;	// no B-frames
+
+		if(c->coded_frame->key_frame)
+			pkt.flags |= AV_PKT_FLAG_KEY;
+
+		pkt.stream_index = video_st->index;
+		pkt.data = video_outbuf;
+		pkt.size = out_size;
+		
+		TRACE_SCOPE("write_video", pkt.pts);
+		if(!interleave_packet(&pkt)) {
+			LOGE("Unable to write video frame\n");
+			return;
+		}
+	}
+	
+	if(thumb_thread_running) {
+		// coded_frame describes the packet that just came out, which is only the frame we just put in
+		// when the encoder has no delay (as with the settings above), so match them up by pts
+		bool keyframe = out_size > 0 && c->coded_frame->key_frame && c->coded_frame->pts == frame->pts;
+		bool due = thumb_interval && (!thumb_started || timestamp >= thumb_next_timestamp);
+		if(due || (keyframe && thumb_on_keyframe))
+			queue_thumbnail(frame, timestamp, keyframe);
+		if(due) {
+			if(!thumb_started) {
+				thumb_next_timestamp = timestamp;
+				thumb_started = true;
+			}
+			while(thumb_next_timestamp <= timestamp)
+				thumb_next_timestamp += thumb_interval;
+		}
+	}
+}
+
+// Our own interleaver instead of av_interleaved_write_frame, whose queue grows without bound when one
+// stream stops delivering. Packets wait in a fixed size queue per stream and go out in timestamp order
+// once every stream has something queued, or when a stream has queued more than the byte/delay caps.
+
+// the packet's data is copied, so the caller's buffer can be reused straight away
+bool VideoRecorderImpl::interleave_packet(AVPacket *pkt)
+{
+	if(av_dup_packet(pkt) < 0) {
+		LOGE("could not copy packet for the interleaver\n");
+		return false;
+	}
+	
+	{
+		// the other stream's thread may be holding the lock while it writes to the file
+		TRACE_SCOPE("interleave_wait", pkt->pts);
+		pthread_mutex_lock(&interleave_lock);
+	}
+	
+	if(interleave_skip_video && video_st && pkt->stream_index == video_st->index) {
+		if(pkt->flags & AV_PKT_FLAG_KEY) {
+			interleave_skip_video = false;
+		}
+		else {
+			// references a frame we dropped
+			interleave_dropped++;
+			av_free_packet(pkt);
+			pthread_mutex_unlock(&interleave_lock);
+			return true;
+		}
+	}
+	
+	PacketQueue *q = &interleave_queues[pkt->stream_index];
+	bool ok = true;
+	if(q->count == INTERLEAVE_MAX_PACKETS) {
+		// a full queue always counts as overflowed, so this makes room
+		ok = interleave_write(false);
+	}
+	if(ok) {
+		q->packets[(q->head + q->count) % INTERLEAVE_MAX_PACKETS] = *pkt;
+		q->count++;
+		q->bytes += pkt->size;
+		interleave_bytes += pkt->size;
+		if(interleave_bytes > interleave_peak_bytes)
+			interleave_peak_bytes = interleave_bytes;
+		
+		ok = interleave_write(false);
+	}
+	else {
+		av_free_packet(pkt);
+	}
+	
+	pthread_mutex_unlock(&interleave_lock);
+	return ok;
+}
+
+// time of the n-th queued packet of a stream in microseconds
+int64_t VideoRecorderImpl::queued_packet_time(int stream, int n)
+{
+	static const AVRational microseconds = { 1, 1000000 };
+	PacketQueue *q = &interleave_queues[stream];
+	AVPacket *pkt = &q->packets[(q->head + n) % INTERLEAVE_MAX_PACKETS];
+	if(pkt->dts == AV_NOPTS_VALUE)
+		return AV_NOPTS_VALUE;		// the smallest int64_t, so it goes out first
+	return av_rescale_q(pkt->dts, oc->streams[stream]->time_base, microseconds);
+}
+
+bool VideoRecorderImpl::interleave_overflowed()
+{
+	if(interleave_bytes > interleave_max_bytes)
+		return true;
+	
+	for(unsigned int i = 0; i < oc->nb_streams; i++) {
+		PacketQueue *q = &interleave_queues[i];
+		if(q->count == INTERLEAVE_MAX_PACKETS)
+			return true;
+		if(q->count > 1) {
+			// packets without a timestamp (e.g. from the encoder flush in Close) don't count towards the delay
+			int64_t first = queued_packet_time(i, 0);
+			int64_t last = queued_packet_time(i, q->count - 1);
+			if(first != AV_NOPTS_VALUE && last != AV_NOPTS_VALUE && last - first > interleave_max_delay)
+				return true;
+		}
+	}
+	return false;
+}
+
+// writes out queued packets in timestamp order, called with interleave_lock held
+bool VideoRecorderImpl::interleave_write(bool flushAll)
+{
+	for(;;) {
+		int next = -1;
+		int64_t next_time = 0;
+		bool starved = false;
+		
+		for(unsigned int i = 0; i < oc->nb_streams; i++) {
+			if(!interleave_queues[i].count) {
+				starved = true;
+				continue;
+			}
+			int64_t t = queued_packet_time(i, 0);
+			if(next < 0 || t < next_time) {
+				next = i;
+				next_time = t;
+			}
+		}
+		
+		if(next < 0)
+			return true;
+		
+		bool drop = false;
+		if(starved && !flushAll) {
+			// wait for the other stream unless we've queued too much already
+			if(!interleave_overflowed())
+				return true;
+			interleave_overflows++;
+			drop = interleave_policy == InterleaveOverflowDrop;
+		}
+		
+		PacketQueue *q = &interleave_queues[next];
+		AVPacket pkt = q->packets[q->head];
+		q->head = (q->head + 1) % INTERLEAVE_MAX_PACKETS;
+		q->count--;
+		q->bytes -= pkt.size;
+		interleave_bytes -= pkt.size;
+		
+		if(drop) {
+			interleave_dropped++;
+			// the video frames after a dropped one reference it, so drop them up to the next keyframe
+			bool video = video_st && next == video_st->index;
+			while(video && q->count && !(q->packets[q->head].flags & AV_PKT_FLAG_KEY)) {
+				AVPacket *dependent = &q->packets[q->head];
+				q->head = (q->head + 1) % INTERLEAVE_MAX_PACKETS;
+				q->count--;
+				q->bytes -= dependent->size;
+				interleave_bytes -= dependent->size;
+				interleave_dropped++;
+				av_free_packet(dependent);
+			}
+			// no keyframe queued yet, keep dropping video as it comes in
+			if(video && !q->count)
+				interleave_skip_video = true;
+			av_free_packet(&pkt);
+			continue;
+		}
+		
+		int ret;
+		{
+			// either stream's thread may end up writing the other's packets, the name says whose it is
+			TRACE_SCOPE(video_st && next == video_st->index ? "mux_video" : "mux_audio", pkt.pts);
+			ret = av_write_frame(oc, &pkt);
+		}
+		av_free_packet(&pkt);
+		if(ret != 0)
+			return false;
+	}
+}
+
+bool VideoRecorderImpl::SetInterleaveOptions(unsigned long maxBytes, unsigned long maxDelayMs, InterleaveOverflowPolicy policy)
+{
+	if(policy < 0 || policy >= InterleaveOverflowPolicyMax) {
+		LOGE("Unknown overflow policy passed to SetInterleaveOptions!\n");
+		return false;
+	}
+	pthread_mutex_lock(&interleave_lock);
+	interleave_max_bytes = maxBytes;
+	interleave_max_delay = (int64_t)maxDelayMs * 1000;
+	interleave_policy = policy;
+	pthread_mutex_unlock(&interleave_lock);
+	
+	// options set before Open go in the capture file header
+	if(capture_file) {
+		CaptureInterleaveOptionsFields fields = { (uint32_t)maxBytes, (uint32_t)maxDelayMs, policy, 0 };
+		capture_record(CaptureInterleaveOptions, &fields, sizeof(fields), NULL, NULL, 0);
+	}
+	return true;
+}
+
+bool VideoRecorderImpl::GetStats(RecorderStats *stats)
+{
+	if(!stats)
+		return false;
+	
+	pthread_mutex_lock(&interleave_lock);
+	stats->interleave_queued_packets = interleave_queues[0].count + interleave_queues[1].count;
+	stats->interleave_queued_bytes = interleave_bytes;
+	stats->interleave_peak_bytes = interleave_peak_bytes;
+	stats->interleave_overflows = interleave_overflows;
+	stats->interleave_dropped = interleave_dropped;
+	pthread_mutex_unlock(&interleave_lock);
+	return true;
+}
+
+bool VideoRecorderImpl::SetCaptureFile(const char *capturefile)
+{
+	if(oc) {
+		LOGE("SetCaptureFile must be called before Open\n");
+		return false;
+	}
+	av_freep(&capture_filename);
+	if(capturefile && !(capture_filename = av_strdup(capturefile))) {
+		LOGE("could not copy capture file name\n");
+		return false;
+	}
+	return true;
+}
+
+bool VideoRecorderImpl::open_capture(bool hasAudio)
+{
+	capture_file = fopen(capture_filename, "wb");
+	if(!capture_file) {
+		LOGE("could not open capture file '%s'\n", capture_filename);
+		return false;
+	}
+	// a big buffer keeps the capture from doing small writes on the encoding threads
+	setvbuf(capture_file, NULL, _IOFBF, CAPTURE_BUFFER_SIZE);
+	
+	CaptureFileHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = CAPTURE_FILE_MAGIC;
+	header.version = CAPTURE_FILE_VERSION;
+	header.video_format = capture_video_format;
+	header.video_width = video_width;
+	header.video_height = video_height;
+	header.video_bitrate = video_bitrate;
+	if(hasAudio) {
+		header.audio_format = capture_audio_format;
+		header.audio_channels = audio_channels;
+		header.audio_samplerate = audio_sample_rate;
+		header.audio_bitrate = audio_bit_rate;
+		header.has_audio = 1;
+	}
+	header.interleave_max_bytes = interleave_max_bytes;
+	header.interleave_max_delay_ms = interleave_max_delay / 1000;
+	header.interleave_policy = interleave_policy;
+	header.thumb_format = thumb_format;
+	header.thumb_width = thumb_width;
+	header.thumb_height = thumb_height;
+	header.thumb_interval = thumb_interval;
+	header.thumb_on_keyframe = thumb_on_keyframe;
+	if(fwrite(&header, sizeof(header), 1, capture_file) != 1) {
+		LOGE("could not write capture file '%s'\n", capture_filename);
+		fclose(capture_file);
+		capture_file = NULL;
+		return false;
+	}
+	
+	capture_start_time = monotonic_time();
+	return true;
+}
+
+// appends one call to the capture file, the audio and video threads may both be calling
+void VideoRecorderImpl::capture_record(CaptureRecordType type, const void *fields, int fieldsSize, const void * const data[], const unsigned long sizes[], int numData)
+{
+	static const uint8_t padding[8] = { 0 };
+	
+	CaptureRecord record;
+	record.type = type;
+	record.size = fieldsSize;
+	for(int i = 0; i < numData; i++)
+		record.size += sizes[i];
+	record.arrival = monotonic_time() - capture_start_time;
+	
+	pthread_mutex_lock(&capture_lock);
+	bool ok = fwrite(&record, sizeof(record), 1, capture_file) == 1;
+	ok = ok && fwrite(fields, fieldsSize, 1, capture_file) == 1;
+	for(int i = 0; i < numData && ok; i++)
+		ok = !sizes[i] || fwrite(data[i], sizes[i], 1, capture_file) == 1;
+	if(ok && (record.size & 7))
+		ok = fwrite(padding, 8 - (record.size & 7), 1, capture_file) == 1;
+	pthread_mutex_unlock(&capture_lock);
+	
+	if(!ok)
+		LOGE("could not write capture file '%s'\n", capture_filename);
+}
+
+bool VideoRecorderImpl::SetTraceFile(const char *jsonfile)
+{
+#ifdef AVR_TRACE
+	av_freep(&trace_filename);
+	if(jsonfile && !(trace_filename = av_strdup(jsonfile))) {
+		LOGE("could not copy trace file name\n");
+		return false;
+	}
+	return true;
+#else
+	(void)jsonfile;
+	LOGE("tracing isn't compiled in, rebuild with -DAVR_TRACE\n");
+	return false;
+#endif
+}
+
+bool VideoRecorderImpl::DumpTrace(const char *jsonfile)
+{
+#ifdef AVR_TRACE
+	return trace_dump(jsonfile);
+#else
+	(void)jsonfile;
+	LOGE("tracing isn't compiled in, rebuild with -DAVR_TRACE\n");
+	return false;
+#endif
+}
+
+bool VideoRecorderImpl::SetThumbnailOptions(ThumbnailFormat fmt, int width, int height, unsigned long intervalMs, bool onKeyframes, ThumbnailCallback callback, void *userdata, const char *thumbfile)
+{
+	if(fmt < 0 || fmt >= ThumbnailFormatMax) {
+		LOGE("Unknown thumbnail format passed to SetThumbnailOptions!\n");
+		return false;
+	}
+	if(width < 2 || height < 2 || width > video_width || height > video_height) {
+		LOGE("thumbnails must be at least 2x2 and no larger than the video\n");
+		return false;
+	}
+	if(!callback && !thumbfile) {
+		LOGE("thumbnails need a callback or a file to go to\n");
+		return false;
+	}
+	thumb_format = fmt;
+	thumb_width = width;
+	thumb_height = height;
+	thumb_interval = intervalMs;
+	thumb_on_keyframe = onKeyframes;
+	thumb_callback = callback;
+	thumb_userdata = userdata;
+	av_freep(&thumb_filename);
+	if(thumbfile && !(thumb_filename = av_strdup(thumbfile))) {
+		LOGE("could not copy thumbnail file name\n");
+		return false;
+	}
+	return true;
+}
+
+bool VideoRecorderImpl::open_thumbnails()
+{
+	AVCodecContext *c = video_st->codec;
+	
+	thumb_source = alloc_picture(PIX_FMT_YUV420P, c->width, c->height);
+	thumb_picture = alloc_picture(PIX_FMT_YUV420P, thumb_width, thumb_height);
+	thumb_rowsum = (uint32_t *)av_malloc(c->width * sizeof(uint32_t));
+	if(!thumb_source || !thumb_picture || !thumb_rowsum) {
+		LOGE("could not allocate thumbnail buffers\n");
+		return false;
+	}
+	
+	if(thumb_format == ThumbnailFormatRGBA) {
+		thumb_rgba = alloc_picture(PIX_FMT_RGBA, thumb_width, thumb_height);
+		if(!thumb_rgba) {
+			LOGE("could not allocate thumbnail buffers\n");
+			return false;
+		}
+		thumb_convert_ctx = sws_getContext(thumb_width, thumb_height, PIX_FMT_YUV420P, thumb_width, thumb_height, PIX_FMT_RGBA, SWS_POINT, NULL, NULL, NULL);
+		if(!thumb_convert_ctx) {
+			LOGE("Could not initialize thumbnail sws context\n");
+			return false;
+		}
+	}
+	
+	if(thumb_filename) {
+		thumb_file = fopen(thumb_filename, "wb");
+		if(!thumb_file) {
+			LOGE("could not open thumbnail file '%s'\n", thumb_filename);
+			return false;
+		}
+	}
+	
+	thumb_started = false;
+	thumb_pending = false;
+	thumb_quit = false;
+	thumb_skipped = 0;
+	
+	pthread_mutex_init(&thumb_lock, NULL);
+	pthread_cond_init(&thumb_cond, NULL);
+	if(pthread_create(&thumb_thread, NULL, thumbnail_thread, this) != 0) {
+		LOGE("could not start thumbnail thread\n");
+		pthread_cond_destroy(&thumb_cond);
+		pthread_mutex_destroy(&thumb_lock);
+		return false;
+	}
+	thumb_thread_running = true;
+	
+	return true;
+}
+
+void VideoRecorderImpl::close_thumbnails()
+{
+	if(thumb_thread_running) {
+		// the thread finishes any pending thumbnail before it quits
+		pthread_mutex_lock(&thumb_lock);
+		thumb_quit = true;
+		pthread_cond_signal(&thumb_cond);
+		pthread_mutex_unlock(&thumb_lock);
+		pthread_join(thumb_thread, NULL);
+		
+		pthread_cond_destroy(&thumb_cond);
+		pthread_mutex_destroy(&thumb_lock);
+		thumb_thread_running = false;
+		
+		if(thumb_skipped)
+			LOG("skipped %lu thumbnails while the thumbnail thread was busy\n", thumb_skipped);
+	}
+	
+	if(thumb_file) {
+		fclose(thumb_file);
+		thumb_file = NULL;
+	}
+	
+	// the options are for one recording, a reopened recorder needs SetThumbnailOptions again
+	av_freep(&thumb_filename);
+	thumb_width = 0;
+	thumb_height = 0;
+	thumb_interval = 0;
+	thumb_on_keyframe = false;
+	thumb_callback = NULL;
+	thumb_userdata = NULL;
+	
+	AVFrame **frames[] = { &thumb_source, &thumb_picture, &thumb_rgba };
+	for(int i = 0; i < 3; i++) {
+		if(*frames[i]) {
+			av_free((*frames[i])->data[0]);
+			av_free(*frames[i]);
+			*frames[i] = NULL;
+		}
+	}
+	
+	if(thumb_convert_ctx) {
+		sws_freeContext(thumb_convert_ctx);
+		thumb_convert_ctx = NULL;
+	}
+	
+	if(thumb_rowsum) {
+		av_free(thumb_rowsum);
+		thumb_rowsum = NULL;
+	}
+}
+
+// hands a copy of the frame to the thumbnail thread, unless it's still busy with the previous one
+void VideoRecorderImpl::queue_thumbnail(AVFrame *frame, unsigned long timestamp, bool keyframe)
+{
+	pthread_mutex_lock(&thumb_lock);
+	bool busy = thumb_pending;
+	pthread_mutex_unlock(&thumb_lock);
+	
+	if(busy) {
+		thumb_skipped++;
+		return;
+	}
+	
+	// the thread only touches thumb_source while thumb_pending is set
+	int chroma_height = (video_height + 1) / 2;
+	for(int y = 0; y < video_height; y++)
+		memcpy(thumb_source->data[0] + y * thumb_source->linesize[0], frame->data[0] + y * frame->linesize[0], video_width);
+	for(int y = 0; y < chroma_height; y++) {
+		memcpy(thumb_source->data[1] + y * thumb_source->linesize[1], frame->data[1] + y * frame->linesize[1], (video_width + 1) / 2);
+		memcpy(thumb_source->data[2] + y * thumb_source->linesize[2], frame->data[2] + y * frame->linesize[2], (video_width + 1) / 2);
+	}
+	
+	pthread_mutex_lock(&thumb_lock);
+	thumb_pending_timestamp = timestamp;
+	thumb_pending_keyframe = keyframe;
+	thumb_pending = true;
+	pthread_cond_signal(&thumb_cond);
+	pthread_mutex_unlock(&thumb_lock);
+}
+
+void *VideoRecorderImpl::thumbnail_thread(void *arg)
+{
+	VideoRecorderImpl *self = (VideoRecorderImpl *)arg;
+	
+	pthread_mutex_lock(&self->thumb_lock);
+	for(;;) {
+		while(!self->thumb_pending && !self->thumb_quit)
+			pthread_cond_wait(&self->thumb_cond, &self->thumb_lock);
+		if(!self->thumb_pending)
+			break;
+		
+		pthread_mutex_unlock(&self->thumb_lock);
+		self->make_thumbnail();
+		pthread_mutex_lock(&self->thumb_lock);
+		
+		self->thumb_pending = false;
+	}
+	pthread_mutex_unlock(&self->thumb_lock);
+	
+	return NULL;
+}
+
+// averages each destination pixel over the block of source pixels it covers
+static void box_downscale_plane(const uint8_t *src, int srcStride, int srcWidth, int srcHeight, uint8_t *dst, int dstStride, int dstWidth, int dstHeight, uint32_t *rowsum)
+{
+	for(int dy = 0; dy < dstHeight; dy++) {
+		int y0 = dy * srcHeight / dstHeight;
+		int y1 = (dy + 1) * srcHeight / dstHeight;
+		if(y1 <= y0)
+			y1 = y0 + 1;
+		
+		// sum the block's rows first so each output pixel only sums along x
+		memset(rowsum, 0, srcWidth * sizeof(uint32_t));
+		for(int y = y0; y < y1; y++) {
+			const uint8_t *s = src + y * srcStride;
+			for(int x = 0; x < srcWidth; x++)
+				rowsum[x] += s[x];
+		}
+		
+		for(int dx = 0; dx < dstWidth; dx++) {
+			int x0 = dx * srcWidth / dstWidth;
+			int x1 = (dx + 1) * srcWidth / dstWidth;
+			if(x1 <= x0)
+				x1 = x0 + 1;
+			
+			uint32_t sum = 0;
+			for(int x = x0; x < x1; x++)
+				sum += rowsum[x];
+			uint32_t n = (x1 - x0) * (y1 - y0);
+			dst[dy * dstStride + dx] = (sum + n / 2) / n;
+		}
+	}
+}
+
+// runs on the thumbnail thread
+void VideoRecorderImpl::make_thumbnail()
+{
+	TRACE_SCOPE("thumbnail", AV_NOPTS_VALUE);
+	int src_chroma_width = (video_width + 1) / 2, src_chroma_height = (video_height + 1) / 2;
+	int dst_chroma_width = (thumb_width + 1) / 2, dst_chroma_height = (thumb_height + 1) / 2;
+	
+	box_downscale_plane(thumb_source->data[0], thumb_source->linesize[0], video_width, video_height,
+						thumb_picture->data[0], thumb_picture->linesize[0], thumb_width, thumb_height, thumb_rowsum);
+	for(int i = 1; i < 3; i++)
+		box_downscale_plane(thumb_source->data[i], thumb_source->linesize[i], src_chroma_width, src_chroma_height,
+							thumb_picture->data[i], thumb_picture->linesize[i], dst_chroma_width, dst_chroma_height, thumb_rowsum);
+	
+	Thumbnail thumb;
+	memset(&thumb, 0, sizeof(thumb));
+	thumb.format = thumb_format;
+	thumb.width = thumb_width;
+	thumb.height = thumb_height;
+	thumb.timestamp = thumb_pending_timestamp;
+	thumb.keyframe = thumb_pending_keyframe;
+	
+	AVFrame *out = thumb_picture;
+	int planes = 3;
+	if(thumb_format == ThumbnailFormatRGBA) {
+		sws_scale(thumb_convert_ctx, thumb_picture->data, thumb_picture->linesize, 0, thumb_height, thumb_rgba->data, thumb_rgba->linesize);
+		out = thumb_rgba;
+		planes = 1;
+	}
+	for(int i = 0; i < planes; i++) {
+		thumb.planes[i] = out->data[i];
+		thumb.strides[i] = out->linesize[i];
+	}
+	
+	if(thumb_callback)
+		thumb_callback(thumb_userdata, &thumb);
+	
+	if(thumb_file) {
+		// alloc_picture lays the planes out back to back, so the whole picture is one block
+		int size = avpicture_get_size(thumb_format == ThumbnailFormatRGBA ? PIX_FMT_RGBA : PIX_FMT_YUV420P, thumb_width, thumb_height);
+		uint32_t header[6] = { THUMBNAIL_FILE_MAGIC, (uint32_t)thumb_format, (uint32_t)thumb_width, (uint32_t)thumb_height, (uint32_t)size, (uint32_t)thumb.timestamp };
+		if(fwrite(header, sizeof(header), 1, thumb_file) != 1 || fwrite(out->data[0], size, 1, thumb_file) != 1)
+			LOGE("could not write thumbnail to '%s'\n", thumb_filename);
+	}
+}
+
+VideoRecorder* VideoRecorder::New()
+{
+	return (VideoRecorder*)(new VideoRecorderImpl);
+}
+
+} // namespace AVR
+
+#ifdef TESTING
+
+float t = 0;
+float tincr = 2 * M_PI * 110.0 / 44100;
+float tincr2 = 2 * M_PI * 110.0 / 44100 / 44100;
+
+void fill_audio_frame(int16_t *samples, int frame_size, int nb_channels)
+{
+	int j, i, v;
+	int16_t *q;
+
+	q = samples;
+	for (j = 0; j < frame_size; j++) {
+		v = (int)(sin(t) * 10000);
+		for(i = 0; i < nb_channels; i++)
+			*q++ = v;
+		t += tincr;
+		tincr += tincr2;
+	}
+}
+
+void fill_yuv_image(AVFrame *pict, int frame_index, int width, int height)
+{
+	int x, y, i;
+
+	i = frame_index;
+
+	/* Y */
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			pict->data[0][y * pict->linesize[0] + x] = x + y + i * 3;
+		}
+	}
+
+	/* Cb and Cr */
+	for (y = 0; y < height/2; y++) {
+		for (x = 0; x < width/2; x++) {
+			pict->data[1][y * pict->linesize[1] + x] = 128 + y + i * 2;
+			pict->data[2][y * pict->linesize[2] + x] = 64 + x + i * 5;
+		}
+	}
+}
+
+#define RGB565(r,g,b) (uint16_t)( ((red & 0x1F) << 11) | ((green & 0x3F) << 5) | (blue & 0x1F) ) 
+
+void fill_rgb_image(uint8_t *pixels, int i, int width, int height)
+{	
+	int x, y;
+	
+	for(y = 0; y < height; y++) {
+		for(x = 0; x < width; x++) {
+			
+			uint8_t red = x + y + i * 3;
+			uint8_t green = x + y + i * 3;
+			uint8_t blue = x + y + i * 3;
+
+			uint16_t pixel = RGB565(red, green, blue);
+
+			// assume linesize is width*2
+			pixels[y * (width*2) + x*2 + 0] = (uint8_t)(pixel);		// lower order bits
+			pixels[y * (width*2) + x*2 + 1] = (uint8_t)(pixel >> 8);	// higher order bits
+		}
+	}
+}
+
+#include <iostream>
+
+int main()
+{
+	AVR::VideoRecorder *recorder = new AVR::VideoRecorderImpl();
+
+	recorder->SetAudioOptions(AVR::AudioSampleFormatS16, 2, 44100, 64000);
+	recorder->SetVideoOptions(AVR::VideoFrameFormatRGB565LE, 640, 480, 400000);
+	recorder->Open("testing.mp4", true, true);
+
+	int16_t *sound_buffer = new int16_t[2048 * 2];
+	uint8_t *video_buffer = new uint8_t[640 * 480 * 2];
+	for(int i = 0; i < 200; i++) {
+		fill_audio_frame(sound_buffer, 900, 2);
+		recorder->SupplyAudioSamples(sound_buffer, 900);
+
+		fill_rgb_image(video_buffer, i, 640, 480);
+		recorder->SupplyVideoFrame(video_buffer, 640*480*2, (25 * i)+1);
+	}
+	
+	delete video_buffer;
+	delete sound_buffer;
+
+	recorder->Close();
+
+	std::cout << "Done" << std::endl;
+
+	delete recorder;
+	
+	return 0;
+}
+
 #endif /* TESTING */
+
+#ifdef REPLAY
+
+// Feeds a capture made with SetCaptureFile back through the recorder, with the original timing (-realtime)
+// or as fast as possible, and reports how long the recorder spent in each kind of call.
+// compiles on Linux with: g++ -DREPLAY VideoRecorder.cpp -o replay -lavformat -lavcodec -lswscale -lavutil -lpthread -O2
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+struct ReplayCallStats {
+	const char *name;
+	unsigned long calls;
+	int64_t total;		// microseconds spent inside the recorder
+	int64_t max;
+};
+
+// bytes per sample times channels, 0 for a format we don't know
+static unsigned long replay_frame_bytes(int fmt, int channels)
+{
+	switch(fmt) {
+		case AVR::AudioSampleFormatU8: return channels;
+		case AVR::AudioSampleFormatS16: return 2 * channels;
+		case AVR::AudioSampleFormatS32:
+		case AVR::AudioSampleFormatFLT: return 4 * channels;
+		case AVR::AudioSampleFormatDBL: return 8 * channels;
+		default: return 0;
+	}
+}
+
+// checks that a record's fields and the data they describe fit inside it. Video is checked against the
+// header's format and size, the same way the recorder reads it, and audio samples against the frame size
+// of the stream or source they're for.
+static bool replay_record_valid(const AVR::CaptureRecord *record, const AVR::CaptureFileHeader *header, unsigned long audio_frame_bytes, const unsigned long source_frame_bytes[], int num_sources)
+{
+	static const size_t fields_size[] = {
+		sizeof(AVR::CaptureVideoFrameFields),
+		sizeof(AVR::CaptureVideoPlanesFields),
+		sizeof(AVR::CaptureAudioSamplesFields),
+		sizeof(AVR::CaptureAddAudioSourceFields),
+		sizeof(AVR::CaptureAudioSourceGainFields),
+		sizeof(AVR::CaptureAudioSourceSamplesFields),
+		sizeof(AVR::CaptureInterleaveOptionsFields),
+	};
+	size_t size = fields_size[record->type - AVR::CaptureVideoFrame];
+	if(record->size < size)
+		return false;
+	uint64_t data_size = record->size - size;
+	const uint8_t *fields = (const uint8_t *)(record + 1);
+	PixelFormat pixfmt = PIX_FMT_NONE;
+	AVR::video_frame_pixfmt((AVR::VideoFrameFormat)header->video_format, &pixfmt);		// checked with the header
+	
+	switch(record->type) {
+		case AVR::CaptureVideoFrame:
+			return data_size >= (uint64_t)avpicture_get_size(pixfmt, header->video_width, header->video_height);
+		case AVR::CaptureVideoPlanes: {
+			const AVR::CaptureVideoPlanesFields *f = (const AVR::CaptureVideoPlanesFields *)fields;
+			if(f->num_planes != AVR::video_plane_count(pixfmt))
+				return false;
+			uint64_t planes_size = 0;
+			for(int i = 0; i < f->num_planes; i++) {
+				if(f->strides[i] < AVR::video_plane_row_bytes(pixfmt, header->video_width, i) ||
+				   f->sizes[i] < AVR::video_plane_size(pixfmt, header->video_width, header->video_height, i, f->strides[i]))
+					return false;
+				planes_size += f->sizes[i];
+			}
+			return planes_size <= data_size;
+		}
+		case AVR::CaptureAudioSamples: {
+			const AVR::CaptureAudioSamplesFields *f = (const AVR::CaptureAudioSamplesFields *)fields;
+			return audio_frame_bytes && f->num_samples <= data_size / audio_frame_bytes;
+		}
+		case AVR::CaptureAudioSourceSamples: {
+			const AVR::CaptureAudioSourceSamplesFields *f = (const AVR::CaptureAudioSourceSamplesFields *)fields;
+			if(f->source < 0 || f->source >= num_sources || !source_frame_bytes[f->source])
+				return false;
+			return f->num_samples <= data_size / source_frame_bytes[f->source];
+		}
+		default:
+			return true;
+	}
+}
+
+static void replay_thumbnail(void *userdata, const AVR::Thumbnail *thumbnail)
+{
+	(*(unsigned long *)userdata)++;
+}
+
+int main(int argc, char **argv)
+{
+	bool realtime = false;
+	int arg = 1;
+	if(arg < argc && !strcmp(argv[arg], "-realtime")) {
+		realtime = true;
+		arg++;
+	}
+	if(argc - arg != 2) {
+		fprintf(stderr, "usage: %s [-realtime] capturefile out.mp4\n", argv[0]);
+		return 2;
+	}
+	const char *capturefile = argv[arg];
+	const char *mp4file = argv[arg + 1];
+	
+	int fd = open(capturefile, O_RDONLY);
+	struct stat st;
+	if(fd < 0 || fstat(fd, &st) != 0) {
+		fprintf(stderr, "could not open '%s'\n", capturefile);
+		return 1;
+	}
+	size_t length = st.st_size;
+	const uint8_t *capture = (const uint8_t *)mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(capture == MAP_FAILED) {
+		fprintf(stderr, "could not map '%s'\n", capturefile);
+		return 1;
+	}
+	
+	const AVR::CaptureFileHeader *header = (const AVR::CaptureFileHeader *)capture;
+	if(length < sizeof(*header) || header->magic != CAPTURE_FILE_MAGIC || header->version != CAPTURE_FILE_VERSION) {
+		fprintf(stderr, "'%s' is not a capture file\n", capturefile);
+		return 1;
+	}
+	PixelFormat pixfmt;
+	if(!AVR::video_frame_pixfmt((AVR::VideoFrameFormat)header->video_format, &pixfmt) || header->video_width <= 0 || header->video_height <= 0) {
+		fprintf(stderr, "'%s' has an invalid video format\n", capturefile);
+		return 1;
+	}
+	
+	AVR::VideoRecorder *recorder = AVR::VideoRecorder::New();
+	bool hasAudio = header->has_audio != 0;
+	unsigned long thumbnails = 0;
+	if(!recorder->SetVideoOptions((AVR::VideoFrameFormat)header->video_format, header->video_width, header->video_height, header->video_bitrate) ||
+	   (hasAudio && !recorder->SetAudioOptions((AVR::AudioSampleFormat)header->audio_format, header->audio_channels, header->audio_samplerate, header->audio_bitrate)) ||
+	   !recorder->SetInterleaveOptions(header->interleave_max_bytes, header->interleave_max_delay_ms, (AVR::InterleaveOverflowPolicy)header->interleave_policy) ||
+	   (header->thumb_width && !recorder->SetThumbnailOptions((AVR::ThumbnailFormat)header->thumb_format, header->thumb_width, header->thumb_height,
+															   header->thumb_interval, header->thumb_on_keyframe != 0, replay_thumbnail, &thumbnails, NULL)) ||
+	   !recorder->Open(mp4file, hasAudio, false)) {
+		fprintf(stderr, "could not set up the recorder\n");
+		return 1;
+	}
+	
+	ReplayCallStats stats[] = {
+		{ "SupplyVideoFrame", 0, 0, 0 },
+		{ "SupplyVideoFrame(planes)", 0, 0, 0 },
+		{ "SupplyAudioSamples", 0, 0, 0 },
+		{ "AddAudioSource", 0, 0, 0 },
+		{ "SetAudioSourceGain", 0, 0, 0 },
+		{ "SupplyAudioSamples(source)", 0, 0, 0 },
+		{ "SetInterleaveOptions", 0, 0, 0 },
+	};
+	
+	unsigned long audio_frame_bytes = hasAudio ? replay_frame_bytes(header->audio_format, header->audio_channels) : 0;
+	unsigned long source_frame_bytes[MAX_AUDIO_SOURCES];
+	int num_sources = 0;
+	
+	int64_t start = AVR::monotonic_time();
+	size_t offset = sizeof(*header);
+	bool ok = true;
+	
+	while(offset < length) {
+		const AVR::CaptureRecord *record = (const AVR::CaptureRecord *)(capture + offset);
+		if(length - offset < sizeof(*record) || length - offset - sizeof(*record) < record->size ||
+		   record->type < AVR::CaptureVideoFrame || record->type > AVR::CaptureInterleaveOptions ||
+		   !replay_record_valid(record, header, audio_frame_bytes, source_frame_bytes, num_sources)) {
+			fprintf(stderr, "capture file is truncated or corrupt at offset %lu\n", (unsigned long)offset);
+			ok = false;
+			break;
+		}
+		const uint8_t *fields = (const uint8_t *)(record + 1);
+		
+		if(realtime) {
+			int64_t wait = start + record->arrival - AVR::monotonic_time();
+			if(wait > 0)
+				usleep(wait);
+		}
+		
+		int64_t before = AVR::monotonic_time();
+		switch(record->type) {
+			case AVR::CaptureVideoFrame: {
+				const AVR::CaptureVideoFrameFields *f = (const AVR::CaptureVideoFrameFields *)fields;
+				recorder->SupplyVideoFrame(f + 1, record->size - sizeof(*f), f->timestamp);
+				break;
+			}
+			case AVR::CaptureVideoPlanes: {
+				const AVR::CaptureVideoPlanesFields *f = (const AVR::CaptureVideoPlanesFields *)fields;
+				const void *planes[4];
+				const uint8_t *data = (const uint8_t *)(f + 1);
+				for(int i = 0; i < f->num_planes; i++) {
+					planes[i] = data;
+					data += f->sizes[i];
+				}
+				recorder->SupplyVideoFrame(planes, f->strides, f->num_planes, f->timestamp);
+				break;
+			}
+			case AVR::CaptureAudioSamples: {
+				const AVR::CaptureAudioSamplesFields *f = (const AVR::CaptureAudioSamplesFields *)fields;
+				recorder->SupplyAudioSamples(f + 1, f->num_samples);
+				break;
+			}
+			case AVR::CaptureAddAudioSource: {
+				const AVR::CaptureAddAudioSourceFields *f = (const AVR::CaptureAddAudioSourceFields *)fields;
+				int source = recorder->AddAudioSource((AVR::AudioSampleFormat)f->format, f->channels, f->gain);
+				if(source >= 0 && source < MAX_AUDIO_SOURCES) {
+					source_frame_bytes[source] = replay_frame_bytes(f->format, f->channels);
+					if(source >= num_sources)
+						num_sources = source + 1;
+				}
+				break;
+			}
+			case AVR::CaptureAudioSourceGain: {
+				const AVR::CaptureAudioSourceGainFields *f = (const AVR::CaptureAudioSourceGainFields *)fields;
+				recorder->SetAudioSourceGain(f->source, f->gain);
+				break;
+			}
+			case AVR::CaptureAudioSourceSamples: {
+				const AVR::CaptureAudioSourceSamplesFields *f = (const AVR::CaptureAudioSourceSamplesFields *)fields;
+				recorder->SupplyAudioSamples(f->source, f + 1, f->num_samples, f->timestamp);
+				break;
+			}
+			case AVR::CaptureInterleaveOptions: {
+				const AVR::CaptureInterleaveOptionsFields *f = (const AVR::CaptureInterleaveOptionsFields *)fields;
+				recorder->SetInterleaveOptions(f->max_bytes, f->max_delay_ms, (AVR::InterleaveOverflowPolicy)f->policy);
+				break;
+			}
+		}
+		int64_t elapsed = AVR::monotonic_time() - before;
+		
+		ReplayCallStats *s = &stats[record->type - AVR::CaptureVideoFrame];
+		s->calls++;
+		s->total += elapsed;
+		if(elapsed > s->max)
+			s->max = elapsed;
+		
+		offset += sizeof(*record) + ((record->size + 7) & ~7);
+	}
+	
+	int64_t before = AVR::monotonic_time();
+	if(!recorder->Close())
+		ok = false;
+	int64_t close_time = AVR::monotonic_time() - before;
+	int64_t total = AVR::monotonic_time() - start;
+	
+	AVR::RecorderStats rs;
+	recorder->GetStats(&rs);
+	delete recorder;
+	
+	printf("%-28s %8s %12s %10s %10s\n", "call", "count", "total ms", "avg us", "max us");
+	for(unsigned int i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+		if(!stats[i].calls)
+			continue;
+		printf("%-28s %8lu %12.1f %10.1f %10lld\n", stats[i].name, stats[i].calls, stats[i].total / 1000.0,
+			   (double)stats[i].total / stats[i].calls, (long long)stats[i].max);
+	}
+	printf("Close %.1f ms, total %.1f ms\n", close_time / 1000.0, total / 1000.0);
+	printf("interleaver peak %lu bytes, %lu overflows, %lu dropped\n", rs.interleave_peak_bytes, rs.interleave_overflows, rs.interleave_dropped);
+	if(header->thumb_width)
+		printf("%lu thumbnails\n", thumbnails);
+	
+	munmap((void *)capture, length);
+	return ok ? 0 : 1;
+}
+
+#endif /* REPLAY */
@@ -33,6 +33,55 @@ enum AudioSampleFormat {
 	AudioSampleFormatMax
 };
 
+// A video frame given plane by plane. YUV420P has 3 planes, NV12/NV21 have 2 and the RGB formats 1.
+struct VideoFrame {
+	const void* planes[4];
+	int strides[4];				// bytes from the start of one row to the next, including any padding
+	int numPlanes;
+	unsigned long timestamp;
+};
+
+enum ThumbnailFormat {
+	ThumbnailFormatI420=0,
+	ThumbnailFormatRGBA,
+	ThumbnailFormatMax
+};
+
+struct Thumbnail {
+	ThumbnailFormat format;
+	int width;
+	int height;
+	const void* planes[3];		// I420 uses all three, RGBA only the first
+	int strides[3];
+	unsigned long timestamp;	// timestamp of the video frame the thumbnail was taken from
+	bool keyframe;
+};
+
+// Called from the thumbnail thread, the planes are only valid during the call
+typedef void (*ThumbnailCallback)(void* userdata,const Thumbnail* thumbnail);
+
+// What to do when one stream has queued more than the interleaver's memory or delay cap
+// while it waits for a packet from the other stream
+enum InterleaveOverflowPolicy {
+	InterleaveOverflowFlush=0,	// write the oldest queued packets anyway, the file stays complete but is interleaved less evenly
+	InterleaveOverflowDrop,		// drop the oldest queued packets (video is dropped up to the next keyframe)
+	InterleaveOverflowPolicyMax
+};
+
+struct RecorderStats {
+	unsigned long interleave_queued_packets;	// packets currently waiting in the interleaver
+	unsigned long interleave_queued_bytes;
+	unsigned long interleave_peak_bytes;		// most bytes ever waiting at once
+	unsigned long interleave_overflows;			// packets released or dropped because a cap was hit
+	unsigned long interleave_dropped;			// packets dropped by InterleaveOverflowDrop
+};
+
+struct AudioSourceStats {
+	unsigned long underruns;	// encoder frames mixed while this source had too few samples buffered (padded with silence)
+	unsigned long overruns;		// samples dropped because their timestamps overlapped audio already received from this source
+	unsigned long buffered;		// samples currently waiting in this source's jitter buffer
+};
+
 class VideoRecorder {
 public:
 	VideoRecorder();
@@ -47,6 +96,18 @@ public:
 	virtual bool SetVideoOptions(VideoFrameFormat fmt,int width,int height,unsigned long bitrate)=0;
 	virtual bool SetAudioOptions(AudioSampleFormat fmt,int channels,unsigned long samplerate,unsigned long bitrate)=0;
 
+	// Optional, caps the memory (default 2MB) and media time (default 1000ms) that packets of one stream
+	// can wait for the other before overflow policy applies
+	virtual bool SetInterleaveOptions(unsigned long maxBytes,unsigned long maxDelayMs,InterleaveOverflowPolicy policy)=0;
+
+	// Optional, call after SetVideoOptions. Emits a downscaled copy of the encoded frame every intervalMs
+	// milliseconds of video (0 disables) and/or on every keyframe, to the callback and/or appended to
+	// thumbfile. Each thumbnail in thumbfile is six native uint32s (magic 'THMB', format, width, height,
+	// data size, timestamp) followed by the packed pixel data. Keyframes are only recognised when the
+	// encoder returns them on the call that supplied the frame, which holds for the zero delay settings
+	// used here. The options last until Close.
+	virtual bool SetThumbnailOptions(ThumbnailFormat fmt,int width,int height,unsigned long intervalMs,bool onKeyframes,ThumbnailCallback callback,void* userdata,const char* thumbfile)=0;
+
 	// Call after SetVideoOptions/SetAudioOptions
 	virtual bool Open(const char* mp4file,bool hasAudio,bool dbg)=0;
 	// Call last
@@ -57,8 +118,40 @@ public:
 	
 	// Supply a video frame
 	virtual void SupplyVideoFrame(const void* frame,unsigned long numBytes,unsigned long timestamp)=0;
-	// Supply audio samples
+	// Supply a video frame with separate plane pointers and strides, so padded camera buffers needn't be repacked.
+	// Every plane pointer must be set, and each stride must be at least the plane's row width in bytes.
+	virtual void SupplyVideoFrame(const void* const planes[],const int strides[],int numPlanes,unsigned long timestamp)=0;
+	// Supply several video frames in one call
+	virtual void SupplyVideoFrames(const VideoFrame* frames,int numFrames)=0;
+	// Supply audio samples. These have no timestamp: the first ones are placed at the last video
+	// frame supplied (or at the first video frame, if audio starts first) and the rest follow on
+	// by sample count, so they should be continuous.
 	virtual void SupplyAudioSamples(const void* samples,unsigned long numSamples)=0;
+
+	// Mixing several audio inputs (e.g. microphone + app audio) into the one AAC stream.
+	// Sources are added after Open and must use the samplerate given to SetAudioOptions;
+	// the encoder must be AudioSampleFormatS16. Each source may be supplied from its own thread.
+	// Don't mix this with the single stream SupplyAudioSamples above.
+
+	// Returns a source id, or -1 on failure
+	virtual int AddAudioSource(AudioSampleFormat fmt,int channels,float gain)=0;
+	virtual bool SetAudioSourceGain(int source,float gain)=0;
+	// Supply audio samples for a source, timestamp in milliseconds on the same clock as the video frames
+	virtual void SupplyAudioSamples(int source,const void* samples,unsigned long numSamples,unsigned long timestamp)=0;
+	virtual bool GetAudioSourceStats(int source,AudioSourceStats* stats)=0;
+
+	virtual bool GetStats(RecorderStats* stats)=0;
+
+	// Optional, call before Open. Logs every SupplyVideoFrame/SupplyAudioSamples call (data, timestamps
+	// and arrival times) to capturefile, along with the interleave and thumbnail options, so the session
+	// can be replayed through the recorder later with the replay tool (VideoRecorder.cpp built with -DREPLAY).
+	virtual bool SetCaptureFile(const char* capturefile)=0;
+
+	// Pipeline tracing, only available when the library is built with -DAVR_TRACE.
+	// Writes the recent conversion/encode/mux events as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+	// SetTraceFile dumps the trace on Close, DumpTrace dumps it immediately.
+	virtual bool SetTraceFile(const char* jsonfile)=0;
+	virtual bool DumpTrace(const char* jsonfile)=0;
 };
 
 } // namespace AVR
@@ -0,0 +1,20 @@
+// NEON inner loop of the audio mixer in VideoRecorder.cpp.
+// build.sh compiles this file on its own with -mfpu=neon, the rest of the library targets plain
+// ARMv7 (vfpv3-d16). VideoRecorder.cpp only calls in here after cpufeatures has reported NEON.
+
+#include <stdint.h>
+#include <arm_neon.h>
+
+namespace AVR {
+
+// dst[i] = dst[i] + src[i], saturated to the S16 range, 8 samples at a time.
+// Returns the number of samples mixed, the caller does the remaining count % 8.
+int mix_samples_s16_neon(int16_t *dst, const int16_t *src, int count)
+{
+	int i = 0;
+	for(; i + 8 <= count; i += 8)
+		vst1q_s16(dst + i, vqaddq_s16(vld1q_s16(dst + i), vld1q_s16(src + i)));
+	return i;
+}
+
+} // namespace AVR
@@ -176,15 +176,18 @@ compile_ffmpeg()
 compile_recorder()
 {
 	echo -e "Compiling recorder"
-	rm -f VideoRecorder.o
-	$CXX $CXXFLAGS -O2 -D__STDC_CONSTANT_MACROS -Iffmpeg -fpic -c VideoRecorder.cpp -o VideoRecorder.o
+	rm -f VideoRecorder.o VideoRecorderNeon.o cpu-features.o
+	$CXX $CXXFLAGS -O2 -D__STDC_CONSTANT_MACROS -Iffmpeg -I$NDK/sources/android/cpufeatures -fpic -c VideoRecorder.cpp -o VideoRecorder.o
+	# the audio mixer's NEON loop, only called when the CPU has NEON
+	$CXX $CXXFLAGS -mfpu=neon -O2 -fpic -c VideoRecorderNeon.cpp -o VideoRecorderNeon.o
+	$CC $CFLAGS -O2 -fpic -c $NDK/sources/android/cpufeatures/cpu-features.c -o cpu-features.o
 	mkdir tempobjs
 	pushd tempobjs
 	$LD -r --whole-archive ../ffmpeg/libfaac.a -o faac.o
 	$LD -r --whole-archive ../ffmpeg/libx264.a -o x264.o
 	$LD -r --whole-archive ../ffmpeg/libffmpeg.a -o ffmpeg.o
 	rm -rf ../libVideoRecorder.a
-	$AR crsv ../libVideoRecorder.a *.o ../VideoRecorder.o
+	$AR crsv ../libVideoRecorder.a *.o ../VideoRecorder.o ../VideoRecorderNeon.o ../cpu-features.o
 	popd
 	rm -rf tempobjs
 }